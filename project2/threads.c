@@ -19,13 +19,40 @@ typedef struct {
     jmp_buf context;
     void *stack_pointer;
     int status; // 0: ready, 1: running, -1: exited
+    int next; // next thread in the ready queue, -1 at its end
 } tcb;
 
 tcb thread_table[128];
 int current_thread = -1;
+int ready_head = -1; // ready threads, oldest first, linked through tcb.next
+int ready_tail = -1;
+
+sigset_t alarm_mask;
 
 void schedule();
 
+void lock() {
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &alarm_mask, NULL);
+}
+
+void unlock() {
+    sigprocmask(SIG_UNBLOCK, &alarm_mask, NULL);
+}
+
+// Makes thread t ready and queues it behind the others. Call with the alarm blocked.
+void make_ready(int t) {
+    thread_table[t].status = 0;
+    thread_table[t].next = -1;
+    if (ready_tail == -1) {
+        ready_head = t;
+    } else {
+        thread_table[ready_tail].next = t;
+    }
+    ready_tail = t;
+}
+
 void init_thread_sys() {
     int i;
     for(i = 0; i < 128; i++) {
@@ -63,7 +90,7 @@ int pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start
         return -1;
     }
     thread_table[new_thread_id].id = (pthread_t)(unsigned long)new_thread_id;
-    thread_table[new_thread_id].status = 0;
+    thread_table[new_thread_id].status = 2; // taken, but not ready until its context is set up
 
     if (setjmp(thread_table[new_thread_id].context) == 0) {
         unsigned long int *stack_top = (unsigned long int *)((char *)thread_table[new_thread_id].stack_pointer + 32767);
@@ -76,6 +103,9 @@ int pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start
         thread_table[new_thread_id].context->__jmpbuf[JB_PC]  = ptr_mangle((unsigned long int)start_thunk);
 
         *thread = thread_table[new_thread_id].id;
+        lock();
+        make_ready(new_thread_id);
+        unlock();
         // first time running pthread_create
         if (new_thread_id == 1) {
             struct sigaction sa;
@@ -93,12 +123,7 @@ int pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start
 void pthread_exit(void *value_ptr) {
     thread_table[current_thread].status = -1;
     free(thread_table[current_thread].stack_pointer);
-    int i;
-    for (i = 0; i < 128; i++) {
-        if (thread_table[i].status == 0 || thread_table[i].status == 1) {
-            raise(SIGALRM);
-        }
-    }
+    schedule(); // only comes back if no other thread is left to run
     exit(0);
 }
 
@@ -106,15 +131,26 @@ pthread_t pthread_self(void) {
     return thread_table[current_thread].id;
 }
 
+// Switches to the thread at the head of the ready queue, queueing the current
+// one behind the others unless it has exited. Exited threads are never in the
+// queue; if it is empty the current thread has exited and this returns.
 void schedule() {
     if (setjmp(thread_table[current_thread].context) == 0) {
+        lock();
         if (thread_table[current_thread].status != -1) {
-            thread_table[current_thread].status = 0;
+            make_ready(current_thread);
+        }
+        if (ready_head == -1) {
+            unlock();
+            return;
+        }
+        current_thread = ready_head;
+        ready_head = thread_table[current_thread].next;
+        if (ready_head == -1) {
+            ready_tail = -1;
         }
-        do {
-            current_thread = (current_thread + 1) % 128;
-        } while (thread_table[current_thread].status != 0);
         thread_table[current_thread].status = 1;
-        longjmp(thread_table[current_thread].context, 1)d;
+        unlock();
+        longjmp(thread_table[current_thread].context, 1);
     }
 }
@@ -26,6 +26,7 @@ typedef struct {
     int status; // 0: ready, 1: running, -1: exited, 2: blocked
     void *exit_value;
     int waiting_on; // threads that are BLOCKED (waiting) for this thread to finish
+    int next; // next thread in the ready queue, -1 at its end
 } tcb;
 
 typedef struct {
@@ -39,6 +40,8 @@ typedef struct {
 tcb thread_table[128];
 int current_thread = -1;
 int total_thread_count = 0;
+int ready_head = -1; // READY threads, oldest first, linked through tcb.next
+int ready_tail = -1;
 
 sigset_t alarm_mask;
 
@@ -54,6 +57,18 @@ void unlock() {
     sigprocmask(SIG_UNBLOCK, &alarm_mask, NULL);
 }
 
+// Makes thread t READY and queues it behind the others. Call with the alarm blocked.
+void make_ready(int t) {
+    thread_table[t].status = READY;
+    thread_table[t].next = -1;
+    if (ready_tail == -1) {
+        ready_head = t;
+    } else {
+        thread_table[ready_tail].next = t;
+    }
+    ready_tail = t;
+}
+
 void pthread_exit_wrapper() {
     unsigned long int res;
     asm("movq %%rax, %0\n":"=r"(res));
@@ -96,7 +111,7 @@ int pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start
         return -1;
     }
     thread_table[new_thread_id].id = (pthread_t)(unsigned long)new_thread_id;
-    thread_table[new_thread_id].status = READY;
+    thread_table[new_thread_id].status = BLOCKED; // taken, but not runnable until its context is set up
     thread_table[new_thread_id].waiting_on = -1; // not waiting on any thread
     if (setjmp(thread_table[new_thread_id].context) == 0) {
         unsigned long int *stack_top = (unsigned long int *)((char *)thread_table[new_thread_id].stack_pointer + 32767);
@@ -107,6 +122,9 @@ int pthread_create (pthread_t *thread, const pthread_attr_t *attr, void *(*start
         thread_table[new_thread_id].context->__jmpbuf[JB_RSP] = ptr_mangle((unsigned long int)stack_top);
         thread_table[new_thread_id].context->__jmpbuf[JB_PC]  = ptr_mangle((unsigned long int)start_thunk);
         *thread = thread_table[new_thread_id].id;
+        lock();
+        make_ready(new_thread_id);
+        unlock();
         // first time running pthread_create
         if (new_thread_id == 1) {
             struct sigaction sa;
@@ -127,7 +145,7 @@ void pthread_exit(void *value_ptr) {
     thread_table[current_thread].exit_value = value_ptr;
     thread_table[current_thread].status = EXITED;
     if(thread_table[current_thread].waiting_on != -1) {
-        thread_table[thread_table[current_thread].waiting_on].status = READY;
+        make_ready(thread_table[current_thread].waiting_on);
     }
     free(thread_table[current_thread].stack_pointer);
     unlock();
@@ -161,15 +179,29 @@ int pthread_join(pthread_t thread, void **value_ptr) {
     return 0;
 }
 
+// Switches to the thread at the head of the ready queue, queueing the current
+// one behind the others if it can still run. Blocked and exited threads are
+// never in the queue. If it is empty the current thread has exited, and the
+// caller carries on to end the process, or every thread left is blocked.
 void schedule() {
     if (setjmp(thread_table[current_thread].context) == 0) {
         lock();
         if (thread_table[current_thread].status == RUNNING) {
-            thread_table[current_thread].status = READY;
+            make_ready(current_thread);
+        }
+        if (ready_head == -1) {
+            if (thread_table[current_thread].status == BLOCKED) {
+                fprintf(stderr, "Error: every thread is blocked\n");
+                exit(1);
+            }
+            unlock();
+            return;
+        }
+        current_thread = ready_head;
+        ready_head = thread_table[current_thread].next;
+        if (ready_head == -1) {
+            ready_tail = -1;
         }
-        do {
-            current_thread = (current_thread + 1) % 128;
-        } while (thread_table[current_thread].status != READY);
         thread_table[current_thread].status = RUNNING;
         unlock();
         longjmp(thread_table[current_thread].context, 1);
@@ -217,7 +249,7 @@ int sem_post(sem_t *sem) {
     my_sem->value++;
     if (my_sem->wait_count > 0) {
         int next_thread = my_sem->waiting_threads[0];
-        thread_table[next_thread].status = READY;
+        make_ready(next_thread);
         int i;
         for(i = 1; i < my_sem->wait_count; i++) {
             my_sem->waiting_threads[i - 1] = my_sem->waiting_threads[i];
@@ -0,0 +1,455 @@
+// Workload generator for the file system: times sequential and random reads
+// and writes, small-file churn, many open descriptors and a mixed load, and
+// prints the per-operation counters and latency histograms of fs_stats after
+// each run. A last run times disk_scrub checking every block's checksum; -c
+// makes the disk without checksums, to see what keeping them costs the other
+// runs. Run with -h for the options.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "disk.h"
+#include "fs.h"
+
+#define MAX_THREADS 16
+#define CHURN_LIVE 64 // small files each churn thread keeps around
+#define FDS_FILES 8 // files the descriptor workload spreads its 32 descriptors over
+#define FDS_OPEN 32
+
+static const char *op_names[FS_OPS] = {
+    "open", "close", "create", "delete", "read", "write", "lseek",
+    "truncate", "filesize", "mkdir", "list", "clone", "sync"
+};
+
+// Settings, from the command line
+static char *disk_name = "bench.img";
+static int backend = DISK_FILE;
+static off_t file_bytes = 16 << 20; // per thread
+static int record = 4096; // bytes per read or write call
+static int threads = 1;
+static long ops = 20000; // per thread, for the random, churn, fds and mixed runs
+static int block_bytes = BLOCK_SIZE;
+static int compress = 0;
+static int checksums = 1;
+
+struct worker {
+    int id;
+    uint64_t rng;
+    long long bytes; // moved by this thread
+    long done; // operations completed
+    int failed;
+};
+
+static uint64_t next_random(struct worker *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void fill(char *buf, int len, int seed) {
+    int i;
+    for (i = 0; i < len; i++) {
+        buf[i] = (char) (seed * 31 + i / 7); // compresses somewhat, like real data
+    }
+}
+
+static void file_name(char *name, const char *prefix, int a, int b) {
+    snprintf(name, 16, "%s%d_%d", prefix, a, b);
+}
+
+// Opens the data file of worker w, creating it if asked to.
+static int open_data(struct worker *w, int create) {
+    char name[16];
+    file_name(name, "data", w->id, 0);
+    if (create && fs_create(name) < 0) {
+        return -1;
+    }
+    if (create && compress && fs_set_compression(name, 1) < 0) {
+        return -1;
+    }
+    return fs_open(name);
+}
+
+static void *seq_write(void *arg) {
+    struct worker *w = arg;
+    char *buf = malloc(record);
+    int fd = open_data(w, 1);
+    off_t off;
+
+    fill(buf, record, w->id);
+    for (off = 0; fd >= 0 && off < file_bytes; off += record) {
+        int len = file_bytes - off < record ? (int) (file_bytes - off) : record;
+        if (fs_write(fd, buf, len) != len) {
+            w->failed = 1;
+            break;
+        }
+        w->bytes += len;
+        w->done++;
+    }
+    if (fd < 0 || fs_close(fd) < 0) {
+        w->failed = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *seq_read(void *arg) {
+    struct worker *w = arg;
+    char *buf = malloc(record);
+    int fd = open_data(w, 0);
+    ssize_t n;
+
+    while (fd >= 0 && (n = fs_read(fd, buf, record)) > 0) {
+        w->bytes += n;
+        w->done++;
+    }
+    if (fd < 0 || fs_close(fd) < 0) {
+        w->failed = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void random_io(struct worker *w, int write) {
+    char *buf = malloc(record);
+    int fd = open_data(w, 0);
+    long records = file_bytes / record;
+    long i;
+
+    fill(buf, record, w->id + 1);
+    for (i = 0; fd >= 0 && records > 0 && i < ops; i++) {
+        off_t off = (off_t) (next_random(w) % records) * record;
+        ssize_t n;
+        if (fs_lseek(fd, off) < 0) {
+            w->failed = 1;
+            break;
+        }
+        n = write ? fs_write(fd, buf, record) : fs_read(fd, buf, record);
+        if (n != record) {
+            w->failed = 1;
+            break;
+        }
+        w->bytes += n;
+        w->done++;
+    }
+    if (fd < 0 || fs_close(fd) < 0) {
+        w->failed = 1;
+    }
+    free(buf);
+}
+
+static void *rand_read(void *arg) {
+    random_io(arg, 0);
+    return NULL;
+}
+
+static void *rand_write(void *arg) {
+    random_io(arg, 1);
+    return NULL;
+}
+
+// Creates, writes and deletes small files, keeping CHURN_LIVE of them around.
+static void *churn(void *arg) {
+    struct worker *w = arg;
+    char buf[8192];
+    char name[16];
+    long i;
+
+    fill(buf, sizeof(buf), w->id);
+    for (i = 0; i < ops; i++) {
+        int len = 1 + next_random(w) % sizeof(buf);
+        int fd;
+        if (i >= CHURN_LIVE) {
+            file_name(name, "c", w->id, (int) ((i - CHURN_LIVE) % (2 * CHURN_LIVE)));
+            if (fs_delete(name) < 0) {
+                w->failed = 1;
+                break;
+            }
+        }
+        file_name(name, "c", w->id, (int) (i % (2 * CHURN_LIVE)));
+        if (fs_create(name) < 0 || (fd = fs_open(name)) < 0) {
+            w->failed = 1;
+            break;
+        }
+        if (fs_write(fd, buf, len) != len) {
+            w->failed = 1;
+        }
+        fs_close(fd);
+        w->bytes += len;
+        w->done++;
+    }
+    long end = i;
+    for (i = end > CHURN_LIVE ? end - CHURN_LIVE : 0; i < end; i++) {
+        file_name(name, "c", w->id, (int) (i % (2 * CHURN_LIVE)));
+        fs_delete(name);
+    }
+    return NULL;
+}
+
+// Reads round robin through every descriptor the file system has, shared
+// out between the threads and spread over a few files. Each descriptor
+// reads on sequentially from a random place until it hits the end.
+static void *many_fds(void *arg) {
+    struct worker *w = arg;
+    char *buf = malloc(record);
+    int fds[FDS_OPEN];
+    int i, nfds = 0;
+    long records = file_bytes / record;
+
+    for (i = w->id; i < FDS_OPEN; i += threads) {
+        char name[16];
+        file_name(name, "data", i % FDS_FILES % threads, 0);
+        if ((fds[nfds] = fs_open(name)) >= 0) {
+            fs_lseek(fds[nfds], (off_t) (next_random(w) % records) * record);
+            nfds++;
+        }
+    }
+    for (i = 0; nfds > 0 && records > 0 && i < ops; i++) {
+        int fd = fds[i % nfds];
+        if (fs_read(fd, buf, record) != record) {
+            fs_lseek(fd, (off_t) (next_random(w) % records) * record);
+            continue;
+        }
+        w->bytes += record;
+        w->done++;
+    }
+    for (i = 0; i < nfds; i++) {
+        fs_close(fds[i]);
+    }
+    if (nfds == 0) {
+        w->failed = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+// 70% random reads, 20% random writes of the thread's data file, and 10%
+// creating or deleting a small file.
+static void *mixed(void *arg) {
+    struct worker *w = arg;
+    char *buf = malloc(record);
+    char name[16];
+    int fd = open_data(w, 0);
+    long records = file_bytes / record;
+    int files = 0;
+    long i;
+
+    fill(buf, record, w->id + 2);
+    for (i = 0; fd >= 0 && records > 0 && i < ops; i++) {
+        int pick = next_random(w) % 10;
+        if (pick == 9) {
+            if (files < CHURN_LIVE && (files == 0 || next_random(w) % 2)) {
+                file_name(name, "m", w->id, files);
+                int f = fs_create(name) < 0 ? -1 : fs_open(name);
+                if (f < 0) {
+                    w->failed = 1;
+                    break;
+                }
+                fs_write(f, buf, record);
+                fs_close(f);
+                files++;
+            } else {
+                file_name(name, "m", w->id, --files);
+                fs_delete(name);
+            }
+        } else {
+            fs_lseek(fd, (off_t) (next_random(w) % records) * record);
+            ssize_t n = pick < 7 ? fs_read(fd, buf, record) : fs_write(fd, buf, record);
+            if (n != record) {
+                w->failed = 1;
+                break;
+            }
+            w->bytes += n;
+        }
+        w->done++;
+    }
+    while (files > 0) {
+        file_name(name, "m", w->id, --files);
+        fs_delete(name);
+    }
+    if (fd < 0 || fs_close(fd) < 0) {
+        w->failed = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void print_stats(void) {
+    struct fs_stats st;
+    int op, i;
+
+    fs_stats(&st);
+    printf("  %-9s %9s %6s %9s %9s %9s %9s\n", "op", "calls", "errors", "avg us", "p50 us", "p99 us", "max us");
+    for (op = 0; op < FS_OPS; op++) {
+        struct fs_op_stats *o = &st.op[op];
+        unsigned long long seen = 0, p50 = 0, p99 = 0;
+        if (o->calls == 0) {
+            continue;
+        }
+        // percentiles are the upper bound of the bucket they fall in
+        for (i = 0; i < FS_LAT_BUCKETS; i++) {
+            seen += o->hist[i];
+            if (!p50 && seen * 2 >= o->calls) {
+                p50 = 1ull << i;
+            }
+            if (!p99 && seen * 100 >= o->calls * 99) {
+                p99 = 1ull << i;
+            }
+        }
+        printf("  %-9s %9llu %6llu %9.1f %9llu %9llu %9.1f\n", op_names[op], o->calls, o->errors,
+               o->total_ns / 1e3 / o->calls, p50, p99, o->max_ns / 1e3);
+    }
+    printf("  cache: %llu hits, %llu misses, %llu writebacks\n", st.cache_hits, st.cache_misses,
+           st.cache_writebacks);
+}
+
+// Times disk_scrub reading the whole disk, bytes long, and checking it against
+// the block checksums with as many threads as the other runs use.
+static int run_scrub(off_t bytes) {
+    if (!checksums) {
+        printf("%-9s skipped, the disk has no checksums\n", "scrub");
+        return 0;
+    }
+    double start = now();
+    int bad = disk_scrub(threads);
+    double secs = now() - start;
+    long blocks = bytes / block_bytes;
+
+    printf("%-9s %8.3f s %10.0f ops/s %9.1f MB/s%s\n", "scrub", secs, blocks / secs, bytes / secs / (1 << 20),
+           bad != 0 ? "  (FAILED)" : "");
+    return bad != 0 ? -1 : 0;
+}
+
+// Runs body on every thread and reports the totals; sync adds an fs_sync to
+// the timed part, so that written data is counted once it reached the disk.
+static int run(const char *name, void *(*body)(void *), int sync) {
+    pthread_t tids[MAX_THREADS];
+    struct worker w[MAX_THREADS];
+    long long bytes = 0;
+    long done = 0;
+    int i, failed = 0;
+
+    memset(w, 0, sizeof(w));
+    fs_reset_stats();
+    double start = now();
+    for (i = 0; i < threads; i++) {
+        w[i].id = i;
+        w[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pthread_create(&tids[i], NULL, body, &w[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        bytes += w[i].bytes;
+        done += w[i].done;
+        failed |= w[i].failed;
+    }
+    if (sync && fs_sync() < 0) {
+        failed = 1;
+    }
+    double secs = now() - start;
+
+    printf("%-9s %8.3f s %10.0f ops/s %9.1f MB/s%s\n", name, secs, done / secs, bytes / secs / (1 << 20),
+           failed ? "  (FAILED)" : "");
+    print_stats();
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] [workload...]\n"
+            "workloads: seqwrite seqread randread randwrite churn fds mixed scrub (default: all, in that order)\n"
+            "  -d name   disk image (default bench.img); name1,name2,... stripes it over several\n"
+            "  -b type   backend: file, mmap, ram or direct (default file)\n"
+            "  -s MB     data file size per thread (default 16)\n"
+            "  -r bytes  bytes per read or write call (default 4096)\n"
+            "  -t n      threads (default 1, at most %d)\n"
+            "  -n ops    operations per thread for the random and small-file runs (default 20000)\n"
+            "  -B bytes  file system block size (default %d)\n"
+            "  -z        store the data files compressed\n"
+            "  -c        make the disk without block checksums\n",
+            prog, MAX_THREADS, BLOCK_SIZE);
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        void *(*body)(void *);
+        int sync;
+    } workloads[] = {
+        { "seqwrite", seq_write, 1 }, { "seqread", seq_read, 0 }, { "randread", rand_read, 0 },
+        { "randwrite", rand_write, 1 }, { "churn", churn, 1 }, { "fds", many_fds, 0 },
+        { "mixed", mixed, 1 }, { "scrub", NULL, 0 },
+    };
+    int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+    int c, i, failed = 0;
+
+    while ((c = getopt(argc, argv, "d:b:s:r:t:n:B:zch")) != -1) {
+        switch (c) {
+        case 'd': disk_name = optarg; break;
+        case 'b':
+            backend = !strcmp(optarg, "mmap") ? DISK_MMAP : !strcmp(optarg, "ram") ? DISK_RAM
+                    : !strcmp(optarg, "direct") ? DISK_DIRECT : DISK_FILE;
+            break;
+        case 's': file_bytes = (off_t) atol(optarg) << 20; break;
+        case 'r': record = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': ops = atol(optarg); break;
+        case 'B': block_bytes = atoi(optarg); break;
+        case 'z': compress = 1; break;
+        case 'c': checksums = 0; break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || record < 1 || file_bytes < record) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // room for every data file twice over, plus the small files
+    off_t disk_bytes = 2 * file_bytes * threads + ((off_t) 64 << 20);
+    disk_set_backend(backend);
+    disk_set_checksums(checksums);
+    if (make_fs_geometry(disk_name, disk_bytes, block_bytes) < 0 || mount_fs(disk_name) < 0) {
+        fprintf(stderr, "%s: cannot make the file system on %s\n", argv[0], disk_name);
+        return 1;
+    }
+
+    // seqwrite makes the data files every other workload uses, so it always runs
+    for (i = 0; i < nworkloads; i++) {
+        int wanted = optind == argc || i == 0;
+        int j;
+        for (j = optind; j < argc; j++) {
+            wanted |= !strcmp(argv[j], workloads[i].name);
+        }
+        if (!wanted) {
+            continue;
+        }
+        if (workloads[i].body ? run(workloads[i].name, workloads[i].body, workloads[i].sync) < 0
+                              : run_scrub(disk_bytes) < 0) {
+            failed = 1;
+        }
+    }
+
+    if (umount_fs(disk_name) < 0) {
+        failed = 1;
+    }
+    if (backend != DISK_RAM) {
+        // a striped volume leaves one image per name
+        char *names = strdup(disk_name), *name;
+        for (name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+            unlink(name);
+        }
+        free(names);
+    }
+    return failed;
+}
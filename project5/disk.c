@@ -1,125 +1,2024 @@
+#define _GNU_SOURCE             /* for fallocate and O_DIRECT                 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define DEFAULT_BYTES ((size_t) DISK_BLOCKS * BLOCK_SIZE)
+#define MAX_RAM_DISKS 8
+#define TRAILER_MAGIC 0x44534b43       /* "DSKC": the image has checksums     */
+#define SCRUB_CHUNK 256                /* blocks a scrub thread reads at once */
+#define CSUM_LOCKS 64                  /* locks keeping blocks and their      */
+#define CSUM_LOCK_BLOCKS 16            /* checksums together, each for runs   */
+                                       /* of this many blocks                 */
+#define MAX_SCRUB_THREADS 64
+#define IO_THREADS 2                   /* default number of I/O threads       */
+#define MAX_IO_THREADS 16
+#define IO_MERGE_BLOCKS 256            /* most blocks moved by one transfer   */
+#define DIRECT_ALIGN 4096              /* alignment direct I/O transfers need */
+#define DIRECT_BOUNCE (1 << 20)        /* largest unaligned direct transfer   */
+#define MAX_MEMBERS 16                 /* most images a volume is striped on  */
+#define STRIPE_BYTES (64 * 1024)       /* bytes of a volume on one image      */
+
+/******************************************************************************/
+/* One image file of the open disk: the whole disk, or one member of a        */
+/* striped volume, with the I/O thread serving it then.                       */
+struct member {
+  int handle;                 /* file handle to the image                   */
+  char *image;                /* mapped or in-memory image                  */
+  size_t image_size;          /* bytes at image                             */
+  pthread_t worker;
+  pthread_cond_t work;        /* jobs waiting                               */
+  struct stripe_job *jobs;    /* waiting, oldest first                      */
+  struct stripe_job **last;   /* where the next job goes                    */
+};
+
+/* A backend moves bytes between memory and a disk image m. read and write    */
+/* transfer exactly len bytes at byte offset off; readv and writev may be     */
+/* NULL, in which case the iovec is handled one buffer at a time; ptr returns */
+/* the address of a byte offset for backends that keep the image in memory   */
+/* and NULL otherwise; discard, which may be NULL, drops the contents of len  */
+/* bytes at off so that the image stops using space for them; sync, NULL for  */
+/* images nothing outlives, waits until what was written is on stable         */
+/* storage. create makes an image of size zero bytes that ends with the len   */
+/* bytes at tail.                                                             */
+struct backend {
+  int (*create)(char *name, size_t size, char *tail, size_t len);
+  int (*open)(struct member *m, char *name);
+  int (*close)(struct member *m);
+  int (*read)(struct member *m, char *buf, size_t len, off_t off);
+  int (*write)(struct member *m, char *buf, size_t len, off_t off);
+  int (*readv)(struct member *m, struct iovec *iov, int cnt, off_t off);
+  int (*writev)(struct member *m, struct iovec *iov, int cnt, off_t off);
+  char *(*ptr)(struct member *m, off_t off);
+  int (*discard)(struct member *m, size_t len, off_t off);
+  int (*sync)(struct member *m);
+};
+
+struct ram_disk {
+  char *name;
+  char *data;
+  size_t size;
+};
+
+/* Images made with checksums on hold a CRC32C of every block in a table     */
+/* after the last block, and end with this trailer.                          */
+struct disk_trailer {
+  uint32_t magic;
+  int32_t blocks;             /* geometry the table was made for            */
+  int32_t size;
+  int32_t clean;              /* 0 while open: a crash may have separated   */
+                              /* blocks from their table entries            */
+};
+
 /******************************************************************************/
 static int active = 0;  /* is the virtual disk open (active) */
-static int handle;      /* file handle to virtual disk       */
+
+static struct member members[MAX_MEMBERS];  /* images of the open disk    */
+static int member_count = 1;
+
+static int disk_blocks = DISK_BLOCKS;   /* geometry of the open disk          */
+static int block_size = BLOCK_SIZE;
+
+static const struct backend *backend;   /* backend of the open disk           */
+static int next_backend = DISK_FILE;    /* used by the next make/open_disk    */
+
+static struct ram_disk ram_disks[MAX_RAM_DISKS];
+
+static int next_checksums = 1;          /* used by the next make_disk         */
+static uint32_t *csums;                 /* checksum of each block, 0 if none  */
+static int csum_blocks;                 /* geometry of the table              */
+static int csum_size;
+static off_t csum_off;                  /* where the table is in the image    */
+static int csum_active;                 /* table matches the current geometry */
+static unsigned char *csum_unsure;      /* per block, after an unclean close: */
+                                        /* the entry may predate the data     */
+static pthread_rwlock_t csum_locks[CSUM_LOCKS] = {
+  [0 ... CSUM_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static pthread_t scrubber;              /* background disk_scrub_start        */
+static int scrub_threads;
+static int scrub_running;
+static int scrub_result;
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_work = PTHREAD_COND_INITIALIZER;  /* queue not empty */
+static pthread_cond_t io_idle = PTHREAD_COND_INITIALIZER;  /* requests done   */
+static struct disk_request **io_queue;  /* waiting requests, by block number  */
+static int io_queue_len, io_queue_cap;
+static int io_pending;                  /* submitted and not yet finished     */
+static int io_head;                     /* block the elevator is at           */
+static pthread_t io_workers[MAX_IO_THREADS];
+static int io_threads = IO_THREADS;     /* started by the next submission     */
+static int io_running;
+static int io_stop_flag;
+
+static pthread_rwlock_t direct_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void io_stop(void);
+static void close_images(void);
+
+/******************************************************************************/
+/* file backend: positional I/O on the image file, retrying short transfers   */
+/* so that no separate lseek is needed                                        */
+
+static int file_create(char *name, size_t size, char *tail, size_t len)
+{
+  int f;
+
+  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("make_disk: cannot open file");
+    return -1;
+  }
+
+  /* the image starts out as one big hole: nothing is written, and blocks     */
+  /* only take space on the host once the file system writes them             */
+  if (ftruncate(f, (off_t) size) < 0) {
+    perror("make_disk: cannot size file");
+    close(f);
+    return -1;
+  }
+
+  if ((len > 0) && (pwrite(f, tail, len, (off_t) (size - len)) != (ssize_t) len)) {
+    perror("make_disk: cannot write file");
+    close(f);
+    return -1;
+  }
+
+  close(f);
+
+  return 0;
+}
+
+static int file_open(struct member *m, char *name)
+{
+  int f;
+
+  if ((f = open(name, O_RDWR, 0644)) < 0) {
+    perror("open_disk: cannot open file");
+    return -1;
+  }
+
+  m->handle = f;
+
+  return 0;
+}
+
+static int file_close(struct member *m)
+{
+  close(m->handle);
+  m->handle = 0;
+
+  return 0;
+}
+
+static int file_write(struct member *m, char *buf, size_t len, off_t off)
+{
+  while (len > 0) {
+    ssize_t n = pwrite(m->handle, buf, len, off);
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+static int file_read(struct member *m, char *buf, size_t len, off_t off)
+{
+  while (len > 0) {
+    ssize_t n = pread(m->handle, buf, len, off);
+    if (n < 0)
+      return -1;
+    if (n == 0) {               /* past the end of the file: reads as zeros   */
+      memset(buf, 0, len);
+      return 0;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+static int file_discard(struct member *m, size_t len, off_t off)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if ((fallocate(m->handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) < 0) &&
+      (errno != EOPNOTSUPP) && (errno != ENOSYS))
+    return -1;
+#endif
+  return 0;                     /* no hole punching here: the data just stays */
+}
+
+static int file_sync(struct member *m)
+{
+  return fdatasync(m->handle);
+}
+
+static int file_vector_io(struct member *m, int write, struct iovec *iov, int cnt, off_t off)
+{
+  int i, first = 0;
+  size_t left = 0;
+
+  for (i = 0; i < cnt; ++i)
+    left += iov[i].iov_len;
+
+  while (left > 0) {
+    ssize_t done = write ? pwritev(m->handle, iov + first, cnt - first, off)
+                         : preadv(m->handle, iov + first, cnt - first, off);
+    if (done < 0 || (write && done == 0))
+      return -1;
+    if (done == 0) {            /* past the end of the file: reads as zeros   */
+      for (i = first; i < cnt; ++i)
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+      break;
+    }
+    off += done;
+    left -= done;
+    while (done > 0 && (size_t) done >= iov[first].iov_len) {
+      done -= iov[first].iov_len;
+      ++first;
+    }
+    if (done > 0) {             /* short transfer in the middle of a buffer   */
+      iov[first].iov_base = (char *) iov[first].iov_base + done;
+      iov[first].iov_len -= done;
+    }
+  }
+
+  return 0;
+}
+
+static int file_readv(struct member *m, struct iovec *iov, int cnt, off_t off)
+{
+  return file_vector_io(m, 0, iov, cnt, off);
+}
+
+static int file_writev(struct member *m, struct iovec *iov, int cnt, off_t off)
+{
+  return file_vector_io(m, 1, iov, cnt, off);
+}
+
+/******************************************************************************/
+/* direct backend: like the file backend, but transfers bypass the host's     */
+/* page cache, so blocks cached by the file system are not held twice.        */
+/* Transfers whose buffer, length or offset is not aligned go through an      */
+/* aligned bounce buffer; writes of part of an aligned unit read it first,    */
+/* one at a time, so that neighbouring partial writes do not undo each other. */
+/* Aligned writes can share a unit with such a write when blocks are smaller  */
+/* than one, so they hold direct_lock shared: a read-modify-write never puts  */
+/* back a unit from before an aligned write that landed in the meantime.      */
+
+static int direct_open(struct member *m, char *name)
+{
+  int f;
+
+  if ((f = open(name, O_RDWR | O_DIRECT, 0644)) < 0) {
+    if (errno == EINVAL)        /* the host file system cannot do it          */
+      fprintf(stderr, "open_disk: no direct I/O here, using the page cache\n");
+    return file_open(m, name);  /* or says why the file cannot be opened      */
+  }
+
+  m->handle = f;
+
+  return 0;
+}
+
+static int direct_aligned(char *buf, size_t len, off_t off)
+{
+  return !(((uintptr_t) buf | len | (size_t) off) & (DIRECT_ALIGN - 1));
+}
+
+static int direct_bounce(struct member *m, int write, char *buf, size_t len, off_t off)
+{
+  char *bounce;
+  off_t end = off + len;
+  struct stat st;
+  int result = 0;
+
+  if (posix_memalign((void **) &bounce, DIRECT_ALIGN, DIRECT_BOUNCE))
+    return -1;
+
+  if (write) {
+    pthread_rwlock_wrlock(&direct_lock);
+    if ((fstat(m->handle, &st) == 0) && (st.st_size > end))
+      end = st.st_size;
+  }
+
+  while ((len > 0) && !result) {
+    off_t start = off & ~(off_t) (DIRECT_ALIGN - 1);
+    size_t skip = off - start;
+    size_t n = len < DIRECT_BOUNCE - skip ? len : DIRECT_BOUNCE - skip;
+    size_t span = (skip + n + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+
+    if (!write || skip || (n & (DIRECT_ALIGN - 1)))
+      result = file_read(m, bounce, span, start);
+    if (!result && write) {
+      memcpy(bounce + skip, buf, n);
+      result = file_write(m, bounce, span, start);
+      if (!result && (start + (off_t) span > end))
+        result = ftruncate(m->handle, end); /* not past the end of the file   */
+    } else if (!result)
+      memcpy(buf, bounce + skip, n);
+
+    buf += n;
+    len -= n;
+    off += n;
+  }
+
+  if (write)
+    pthread_rwlock_unlock(&direct_lock);
+  free(bounce);
+
+  return result;
+}
+
+static int direct_read(struct member *m, char *buf, size_t len, off_t off)
+{
+  return direct_aligned(buf, len, off) ? file_read(m, buf, len, off)
+                                       : direct_bounce(m, 0, buf, len, off);
+}
+
+static int direct_write(struct member *m, char *buf, size_t len, off_t off)
+{
+  int result;
+
+  if (!direct_aligned(buf, len, off))
+    return direct_bounce(m, 1, buf, len, off);
+
+  pthread_rwlock_rdlock(&direct_lock);
+  result = file_write(m, buf, len, off);
+  pthread_rwlock_unlock(&direct_lock);
+
+  return result;
+}
+
+static int direct_vector_io(struct member *m, int write, struct iovec *iov, int cnt, off_t off)
+{
+  int i, result;
+
+  for (i = 0; i < cnt; ++i)
+    if (!direct_aligned(iov[i].iov_base, iov[i].iov_len, off))
+      break;
+
+  if ((i == cnt) && !write)
+    return file_vector_io(m, 0, iov, cnt, off);
+
+  if (i == cnt) {
+    pthread_rwlock_rdlock(&direct_lock);
+    result = file_vector_io(m, 1, iov, cnt, off);
+    pthread_rwlock_unlock(&direct_lock);
+    return result;
+  }
+
+  for (i = 0; i < cnt; ++i) {
+    if ((write ? direct_write(m, iov[i].iov_base, iov[i].iov_len, off)
+               : direct_read(m, iov[i].iov_base, iov[i].iov_len, off)) < 0)
+      return -1;
+    off += iov[i].iov_len;
+  }
+
+  return 0;
+}
+
+static int direct_readv(struct member *m, struct iovec *iov, int cnt, off_t off)
+{
+  return direct_vector_io(m, 0, iov, cnt, off);
+}
+
+static int direct_writev(struct member *m, struct iovec *iov, int cnt, off_t off)
+{
+  return direct_vector_io(m, 1, iov, cnt, off);
+}
+
+/******************************************************************************/
+/* mmap backend: the image file is mapped shared, so block contents can be    */
+/* used in place and written back by the kernel                               */
+
+static int mmap_open(struct member *m, char *name)
+{
+  struct stat st;
+
+  if (file_open(m, name) < 0)
+    return -1;
+
+  if (fstat(m->handle, &st) < 0) {
+    perror("open_disk: cannot stat file");
+    file_close(m);
+    return -1;
+  }
+
+  m->image_size = (size_t) st.st_size;
+  if (m->image_size < BLOCK_SIZE) {
+    fprintf(stderr, "open_disk: disk image too small\n");
+    file_close(m);
+    return -1;
+  }
+
+  m->image = mmap(NULL, m->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, m->handle, 0);
+  if (m->image == MAP_FAILED) {
+    perror("open_disk: cannot map file");
+    m->image = NULL;
+    file_close(m);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int mmap_close(struct member *m)
+{
+  msync(m->image, m->image_size, MS_SYNC);
+  munmap(m->image, m->image_size);
+  m->image = NULL;
+
+  return file_close(m);
+}
+
+static int mmap_sync(struct member *m)
+{
+  return msync(m->image, m->image_size, MS_SYNC);
+}
+
+static int memory_read(struct member *m, char *buf, size_t len, off_t off)
+{
+  memcpy(buf, m->image + off, len);
+  return 0;
+}
+
+static int memory_write(struct member *m, char *buf, size_t len, off_t off)
+{
+  memcpy(m->image + off, buf, len);
+  return 0;
+}
+
+static char *memory_ptr(struct member *m, off_t off)
+{
+  return m->image + off;
+}
+
+/******************************************************************************/
+/* RAM backend: images live in process memory, looked up by name, and last    */
+/* until the process exits; nothing ever reaches the kernel                   */
+
+static struct ram_disk *ram_find(char *name)
+{
+  int i;
+
+  for (i = 0; i < MAX_RAM_DISKS; ++i)
+    if (ram_disks[i].name && !strcmp(ram_disks[i].name, name))
+      return &ram_disks[i];
+
+  return NULL;
+}
+
+static int ram_create(char *name, size_t size, char *tail, size_t len)
+{
+  struct ram_disk *d = ram_find(name);
+  int i;
+
+  if (d) {
+    char *data = d->size == size ? d->data : realloc(d->data, size);
+    if (!data) {
+      fprintf(stderr, "make_disk: out of memory\n");
+      return -1;
+    }
+    memset(data, 0, size);
+    memcpy(data + size - len, tail, len);
+    d->data = data;
+    d->size = size;
+    return 0;
+  }
+
+  for (i = 0; i < MAX_RAM_DISKS; ++i)
+    if (!ram_disks[i].name)
+      break;
+
+  if (i == MAX_RAM_DISKS) {
+    fprintf(stderr, "make_disk: too many RAM disks\n");
+    return -1;
+  }
+
+  ram_disks[i].data = calloc(1, size);
+  ram_disks[i].size = size;
+  ram_disks[i].name = strdup(name);
+  if (!ram_disks[i].data || !ram_disks[i].name) {
+    free(ram_disks[i].data);
+    free(ram_disks[i].name);
+    ram_disks[i].data = ram_disks[i].name = NULL;
+    fprintf(stderr, "make_disk: out of memory\n");
+    return -1;
+  }
+  memcpy(ram_disks[i].data + size - len, tail, len);
+
+  return 0;
+}
+
+static int ram_open(struct member *m, char *name)
+{
+  struct ram_disk *d = ram_find(name);
+
+  if (!d) {
+    fprintf(stderr, "open_disk: no RAM disk named %s\n", name);
+    return -1;
+  }
+
+  m->image = d->data;
+  m->image_size = d->size;
+
+  return 0;
+}
+
+static int ram_close(struct member *m)
+{
+  m->image = NULL;
+
+  return 0;
+}
+
+/******************************************************************************/
+static const struct backend backends[] = {
+  [DISK_FILE] = { file_create, file_open, file_close, file_read, file_write,
+                  file_readv, file_writev, NULL, file_discard, file_sync },
+  [DISK_MMAP] = { file_create, mmap_open, mmap_close, memory_read,
+                  memory_write, NULL, NULL, memory_ptr, file_discard, mmap_sync },
+  [DISK_RAM]  = { ram_create, ram_open, ram_close, memory_read, memory_write,
+                  NULL, NULL, memory_ptr, NULL, NULL },
+  [DISK_DIRECT] = { file_create, direct_open, file_close, direct_read,
+                    direct_write, direct_readv, direct_writev, NULL, file_discard,
+                    file_sync },
+};
+
+int disk_set_backend(int type)
+{
+  if ((type < DISK_FILE) || (type > DISK_DIRECT)) {
+    fprintf(stderr, "disk_set_backend: unknown backend\n");
+    return -1;
+  }
+
+  next_backend = type;
+
+  return 0;
+}
+
+static int check_geometry(const char *who, int blocks, int size)
+{
+  if ((size < 512) || (size > (1 << 24)) || (size & (size - 1))) {
+    fprintf(stderr, "%s: block size must be a power of two from 512 to 16M\n", who);
+    return -1;
+  }
+
+  if ((blocks <= 0) || ((size_t) blocks * size < BLOCK_SIZE)) {
+    fprintf(stderr, "%s: disk too small\n", who);
+    return -1;
+  }
+
+  return 0;
+}
+
+/******************************************************************************/
+/* Striped volumes. A disk name listing several images separated by commas,   */
+/* such as "/mnt/a/disk,/mnt/b/disk", names one disk striped over them: byte  */
+/* off of the disk is in stripe off / STRIPE_BYTES, and stripe s is stripe    */
+/* s / n of image s % n. Every image has an I/O thread, so the parts of a     */
+/* transfer that fall on different images move at the same time. The images   */
+/* have to be named in the same order every time.                             */
+
+struct stripe_job {
+  struct stripe_job *next;
+  int write;
+  struct iovec *iov;          /* adjacent bytes of the image                */
+  int cnt;
+  off_t off;                  /* in the image                               */
+  int result;
+  int finished;
+};
+
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER;
+static int stripe_stop;
+static int stripe_running;              /* the images have I/O threads        */
+
+/* split name at its commas into names[]; returns how many, or -1. The        */
+/* names live in one string to be freed with free(names[0]).                  */
+static int split_names(const char *who, char *name, char **names)
+{
+  char *p = strdup(name);
+  int n = 0;
+
+  if (!p) {
+    fprintf(stderr, "%s: out of memory\n", who);
+    return -1;
+  }
+
+  for (;;) {
+    if ((n == MAX_MEMBERS) || !*p || (*p == ',')) {
+      fprintf(stderr, "%s: bad list of disk images\n", who);
+      free(n ? names[0] : p);
+      return -1;
+    }
+    names[n++] = p;
+    if (!(p = strchr(p, ',')))
+      return n;
+    *p++ = '\0';
+  }
+}
+
+/* bytes of a disk of size bytes striped over n images that are on image i    */
+static size_t member_bytes(size_t size, int i, int n)
+{
+  size_t rest = size % ((size_t) n * STRIPE_BYTES);
+  size_t before = (size_t) i * STRIPE_BYTES;
+
+  rest = rest > before ? rest - before : 0;
+  return size / ((size_t) n * STRIPE_BYTES) * STRIPE_BYTES +
+         (rest < STRIPE_BYTES ? rest : STRIPE_BYTES);
+}
+
+/* image holding disk bytes [off, off + len) and where they are on it; NULL   */
+/* if they are spread over several images                                     */
+static struct member *image_member(off_t off, size_t len, off_t *moff)
+{
+  off_t stripe = off / STRIPE_BYTES;
+
+  if (member_count == 1) {
+    *moff = off;
+    return &members[0];
+  }
+
+  if ((len > 0) && ((off_t) (off + len - 1) / STRIPE_BYTES != stripe))
+    return NULL;
+
+  *moff = stripe / member_count * STRIPE_BYTES + off % STRIPE_BYTES;
+  return &members[stripe % member_count];
+}
+
+/* move the cnt buffers of iov to or from adjacent bytes of image m at off    */
+static int member_io(struct member *m, int write, struct iovec *iov, int cnt, off_t off)
+{
+  int i;
+
+  if (write ? backend->writev : backend->readv) {
+    while (cnt > 0) {
+      int n = cnt < IOV_MAX ? cnt : IOV_MAX;
+      size_t len = 0;
+
+      for (i = 0; i < n; ++i)   /* before the backend moves the iovec on      */
+        len += iov[i].iov_len;
+      if ((write ? backend->writev(m, iov, n, off) : backend->readv(m, iov, n, off)) < 0)
+        return -1;
+      off += len;
+      iov += n;
+      cnt -= n;
+    }
+    return 0;
+  }
+
+  for (i = 0; i < cnt; ++i) {
+    if ((write ? backend->write(m, iov[i].iov_base, iov[i].iov_len, off)
+               : backend->read(m, iov[i].iov_base, iov[i].iov_len, off)) < 0)
+      return -1;
+    off += iov[i].iov_len;
+  }
+
+  return 0;
+}
+
+static void *stripe_worker(void *arg)
+{
+  struct member *m = arg;
+  struct stripe_job *job;
+
+  pthread_mutex_lock(&stripe_lock);
+  for (;;) {
+    while (!m->jobs && !stripe_stop)
+      pthread_cond_wait(&m->work, &stripe_lock);
+    if (!(job = m->jobs))
+      break;
+    if (!(m->jobs = job->next))
+      m->last = &m->jobs;
+    pthread_mutex_unlock(&stripe_lock);
+
+    job->result = member_io(m, job->write, job->iov, job->cnt, job->off);
+
+    pthread_mutex_lock(&stripe_lock);
+    job->finished = 1;
+    pthread_cond_broadcast(&stripe_done);
+  }
+  pthread_mutex_unlock(&stripe_lock);
+
+  return NULL;
+}
+
+/* move the buffers of iov to or from the disk bytes at off. On a volume      */
+/* they are cut at stripe boundaries and dealt out to the images; each        */
+/* image's share goes to its I/O thread, but the caller does one itself.      */
+static int image_io(int write, struct iovec *iov, int cnt, off_t off)
+{
+  struct stripe_job jobs[MAX_MEMBERS], *mine = NULL;
+  struct member *one;
+  struct iovec *parts;
+  off_t moff;
+  size_t len = 0;
+  int i, max, result = 0;
+
+  for (i = 0; i < cnt; ++i)
+    len += iov[i].iov_len;
+
+  if ((one = image_member(off, len, &moff)))      /* all on one image         */
+    return member_io(one, write, iov, cnt, moff);
+
+  max = cnt + len / STRIPE_BYTES + 1;   /* most pieces an image can get      */
+  if (!(parts = malloc((size_t) member_count * max * sizeof(*parts))))
+    return -1;
+
+  for (i = 0; i < member_count; ++i) {
+    jobs[i].write = write;
+    jobs[i].iov = parts + (size_t) i * max;
+    jobs[i].cnt = 0;
+    jobs[i].result = 0;
+    jobs[i].finished = 0;
+  }
+
+  for (i = 0; i < cnt; ++i) {
+    char *base = iov[i].iov_base;
+    size_t left = iov[i].iov_len;
+
+    while (left > 0) {
+      struct member *m = image_member(off, 0, &moff);
+      struct stripe_job *job = &jobs[m - members];
+      size_t n = STRIPE_BYTES - off % STRIPE_BYTES;
+
+      if (n > left)
+        n = left;
+      if (!job->cnt)
+        job->off = moff;
+      if (job->cnt && ((char *) job->iov[job->cnt - 1].iov_base +
+                       job->iov[job->cnt - 1].iov_len == base))
+        job->iov[job->cnt - 1].iov_len += n;
+      else {
+        job->iov[job->cnt].iov_base = base;
+        job->iov[job->cnt++].iov_len = n;
+      }
+      base += n;
+      left -= n;
+      off += n;
+    }
+  }
+
+  pthread_mutex_lock(&stripe_lock);
+  for (i = 0; i < member_count; ++i) {
+    if (!jobs[i].cnt)
+      jobs[i].finished = 1;
+    else if (!mine)
+      mine = &jobs[i];
+    else {
+      jobs[i].next = NULL;
+      *members[i].last = &jobs[i];
+      members[i].last = &jobs[i].next;
+      pthread_cond_signal(&members[i].work);
+    }
+  }
+  pthread_mutex_unlock(&stripe_lock);
+
+  mine->result = member_io(&members[mine - jobs], write, mine->iov, mine->cnt, mine->off);
+  mine->finished = 1;
+
+  pthread_mutex_lock(&stripe_lock);
+  for (i = 0; i < member_count; ++i) {
+    while (!jobs[i].finished)
+      pthread_cond_wait(&stripe_done, &stripe_lock);
+    result |= jobs[i].result;
+  }
+  pthread_mutex_unlock(&stripe_lock);
+
+  free(parts);
+
+  return result < 0 ? -1 : 0;
+}
+
+/* stop the I/O threads of the first n images of a volume                     */
+static void stripe_end(int n)
+{
+  int i;
+
+  pthread_mutex_lock(&stripe_lock);
+  stripe_stop = 1;
+  for (i = 0; i < n; ++i)
+    pthread_cond_signal(&members[i].work);
+  pthread_mutex_unlock(&stripe_lock);
+
+  for (i = 0; i < n; ++i) {
+    pthread_join(members[i].worker, NULL);
+    pthread_cond_destroy(&members[i].work);
+  }
+  stripe_stop = 0;
+}
+
+/* start an I/O thread for every image of a volume                            */
+static int stripe_start(void)
+{
+  int i;
+
+  for (i = 0; i < member_count; ++i) {
+    members[i].jobs = NULL;
+    members[i].last = &members[i].jobs;
+    pthread_cond_init(&members[i].work, NULL);
+    if (pthread_create(&members[i].worker, NULL, stripe_worker, &members[i])) {
+      fprintf(stderr, "open_disk: cannot start I/O threads\n");
+      pthread_cond_destroy(&members[i].work);
+      stripe_end(i);
+      return -1;
+    }
+  }
+  stripe_running = 1;
+
+  return 0;
+}
+
+static int image_read(char *buf, size_t len, off_t off)
+{
+  struct iovec iov;
+
+  if (member_count == 1)
+    return backend->read(&members[0], buf, len, off);
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return image_io(0, &iov, 1, off);
+}
+
+static int image_write(char *buf, size_t len, off_t off)
+{
+  struct iovec iov;
+
+  if (member_count == 1)
+    return backend->write(&members[0], buf, len, off);
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return image_io(1, &iov, 1, off);
+}
+
+/* address of disk bytes [off, off + len) on backends that keep images in     */
+/* memory; NULL otherwise, or if the bytes are spread over several images     */
+static char *image_ptr(off_t off, size_t len)
+{
+  struct member *m;
+  off_t moff;
+
+  if (!backend->ptr || !(m = image_member(off, len, &moff)))
+    return NULL;
+
+  return backend->ptr(m, moff);
+}
+
+static int image_discard(size_t len, off_t off)
+{
+  while (len > 0) {
+    off_t moff;
+    struct member *m = image_member(off, 0, &moff);
+    size_t n = member_count == 1 ? len : (size_t) (STRIPE_BYTES - off % STRIPE_BYTES);
+
+    if (n > len)
+      n = len;
+    if (backend->discard(m, n, moff) < 0)
+      return -1;
+    len -= n;
+    off += n;
+  }
+
+  return 0;
+}
+
+/******************************************************************************/
+/* CRC32C (Castagnoli) block checksums. x86 CPUs with SSE4.2 and ARM CPUs     */
+/* with the CRC extension do 8 bytes per instruction; anywhere else a         */
+/* slice-by-8 table does 8 bytes per step.                                    */
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc32c)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;                  /* little-endian, like the CPUs above         */
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) c;
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+static int crc_hw_supported(void)
+{
+  return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+
+static int crc_hw_supported(void)
+{
+  return 1;                     /* the compiler was told the CPU has it       */
+}
+#else
+#define crc32c_hw crc32c_table
+static int crc_hw_supported(void)
+{
+  return 0;
+}
+#endif
+
+static void crc_init(void)
+{
+  uint32_t i, j, crc;
+
+  if (crc32c)
+    return;
+
+  for (i = 0; i < 256; ++i) {
+    crc = i;
+    for (j = 0; j < 8; ++j)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    crc_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; ++i)
+    for (j = 1; j < 8; ++j)
+      crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^ (crc_table[j - 1][i] >> 8);
+
+  crc32c = crc_hw_supported() ? crc32c_hw : crc32c_table;
+}
+
+/* checksum of one block as kept in the table; 0 is left for "none yet"      */
+static uint32_t block_crc(const char *buf)
+{
+  uint32_t crc = ~crc32c(~0u, (const unsigned char *) buf, block_size);
+
+  return crc ? crc : 1;
+}
+
+/* Writing a block and its table entry are two writes, so count blocks at    */
+/* block are locked for both, exclusively, by writers, and shared by readers */
+/* comparing them; otherwise a reader could see one without the other, and   */
+/* two writers could leave one's data with the other's checksum. Locks are   */
+/* taken in order, so ranges overlapping in any way cannot deadlock.         */
+static void csum_lock(int block, int count, int write, int lock)
+{
+  uint64_t want = 0;
+  int i, first = block / CSUM_LOCK_BLOCKS, last = (block + count - 1) / CSUM_LOCK_BLOCKS;
+
+  if (!csum_active || (count <= 0))
+    return;
+
+  if (last - first + 1 >= CSUM_LOCKS)
+    want = ~(uint64_t) 0;
+  else
+    for (i = first; i <= last; ++i)
+      want |= (uint64_t) 1 << (i % CSUM_LOCKS);
+
+  for (i = 0; i < CSUM_LOCKS; ++i)
+    if (want & ((uint64_t) 1 << i)) {
+      if (!lock)
+        pthread_rwlock_unlock(&csum_locks[i]);
+      else if (write)
+        pthread_rwlock_wrlock(&csum_locks[i]);
+      else
+        pthread_rwlock_rdlock(&csum_locks[i]);
+    }
+}
+
+/* write the table entries of count blocks out after the blocks              */
+static int csum_write(int block, int count)
+{
+  return image_write((char *) &csums[block], (size_t) count * sizeof(uint32_t),
+                     csum_off + (off_t) block * sizeof(uint32_t));
+}
+
+/* record the checksums of count blocks just written, from buf or bufs[],    */
+/* and write their table entries out after them                              */
+static int csum_store(int block, int count, char *buf, char **bufs)
+{
+  int i;
+
+  if (!csum_active)
+    return 0;
+
+  for (i = 0; i < count; ++i) {
+    __atomic_store_n(&csums[block + i],
+                     block_crc(bufs ? bufs[i] : buf + (size_t) i * block_size),
+                     __ATOMIC_RELAXED);
+    if (csum_unsure)
+      csum_unsure[block + i] = 0;
+  }
+
+  return csum_write(block, count);
+}
+
+/* compare a block just read, at buf, with its table entry; after an unclean */
+/* close a mismatch only means that the crash came between the block and its */
+/* entry, so the entry is made to match the first time the block is read     */
+static int csum_verify(int block, const char *buf)
+{
+  uint32_t want = __atomic_load_n(&csums[block], __ATOMIC_RELAXED);
+  uint32_t crc;
+
+  if (!want && !(csum_unsure && csum_unsure[block]))
+    return 0;                   /* never written, or discarded                */
+
+  crc = block_crc(buf);
+  if (csum_unsure && csum_unsure[block]) {
+    __atomic_store_n(&csums[block], crc, __ATOMIC_RELAXED);
+    if ((want == crc) || (csum_write(block, 1) == 0))
+      csum_unsure[block] = 0;   /* else adopted again on the next read        */
+    return 0;
+  }
+
+  return want == crc ? 0 : -1;
+}
+
+/* check count blocks just read against the table                            */
+static int csum_check(const char *who, int block, int count, char *buf, char **bufs)
+{
+  int i;
+
+  if (!csum_active)
+    return 0;
+
+  for (i = 0; i < count; ++i)
+    if (csum_verify(block + i, bufs ? bufs[i] : buf + (size_t) i * block_size) < 0) {
+      fprintf(stderr, "%s: checksum mismatch in block %d\n", who, block + i);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* size of image m, found with fstat for the file backends                   */
+static off_t member_size(struct member *m)
+{
+  struct stat st;
+
+  if (backend->ptr)
+    return (off_t) m->image_size;
+
+  return fstat(m->handle, &st) < 0 ? -1 : st.st_size;
+}
+
+/* disk size: the sizes of its images added up                               */
+static off_t image_bytes(void)
+{
+  off_t size = 0, n;
+  int i;
+
+  for (i = 0; i < member_count; ++i) {
+    if ((n = member_size(&members[i])) < 0)
+      return -1;
+    size += n;
+  }
+
+  return size;
+}
+
+/* load the checksum table of the open disk, if its image has one            */
+static int csum_open(void)
+{
+  struct disk_trailer t;
+  off_t size = image_bytes();
+
+  csums = NULL;
+  csum_active = 0;
+  if (size < (off_t) sizeof(t) ||
+      (image_read((char *) &t, sizeof(t), size - sizeof(t)) < 0) ||
+      (t.magic != TRAILER_MAGIC))
+    return 0;                   /* made without checksums                     */
+
+  if ((t.blocks <= 0) || (t.size <= 0) ||
+      (size != (off_t) t.blocks * t.size + (off_t) t.blocks * sizeof(uint32_t) +
+               (off_t) sizeof(t))) {
+    fprintf(stderr, "open_disk: bad checksum table\n");
+    return -1;
+  }
+
+  csum_blocks = t.blocks;
+  csum_size = t.size;
+  csum_off = (off_t) t.blocks * t.size;
+  if (!(csums = malloc((size_t) t.blocks * sizeof(uint32_t))) ||
+      (image_read((char *) csums, (size_t) t.blocks * sizeof(uint32_t), csum_off) < 0)) {
+    fprintf(stderr, "open_disk: cannot read checksum table\n");
+    free(csums);
+    csums = NULL;
+    return -1;
+  }
+
+  if (!t.clean &&
+      (csum_unsure = malloc(t.blocks))) /* without it, mismatches stay errors */
+    memset(csum_unsure, 1, t.blocks);
+
+  crc_init();
+  return 0;
+}
+
+/* mark the trailer clean, once every block and entry is on the disk, or not */
+/* clean, before any can be written; the next open trusts the table only if  */
+/* it finds the disk clean                                                   */
+static int csum_mark(int clean)
+{
+  struct disk_trailer t = { TRAILER_MAGIC, csum_blocks, csum_size, clean };
+
+  if (disk_flush() < 0 ||
+      (image_write((char *) &t, sizeof(t), image_bytes() - sizeof(t)) < 0) ||
+      (disk_flush() < 0)) {
+    fprintf(stderr, "%s: cannot write the checksum trailer\n",
+            clean ? "close_disk" : "open_disk");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* open the image of the disk name, or all the images of the volume it       */
+/* lists, checking that they belong together and starting their I/O threads  */
+static int open_images(char *name)
+{
+  char *names[MAX_MEMBERS];
+  off_t size = 0;
+  int i, n;
+
+  backend = &backends[next_backend];
+  if (!strchr(name, ','))
+    return backend->open(&members[0], name);
+
+  if ((n = split_names("open_disk", name, names)) < 0)
+    return -1;
+
+  for (i = 0; (i < n) && (backend->open(&members[i], names[i]) == 0); ++i)
+    size += member_size(&members[i]);
+  free(names[0]);
+  member_count = i;
+
+  if (member_count == n) {
+    for (i = 0; i < n; ++i)
+      if (member_size(&members[i]) != (off_t) member_bytes(size, i, n))
+        break;
+    if (i < n)
+      fprintf(stderr, "open_disk: the images are not all of one volume\n");
+    else if (stripe_start() == 0)
+      return 0;
+  }
+
+  close_images();
+  return -1;
+}
+
+/* stop the I/O threads of a volume and close the images of the disk          */
+static void close_images(void)
+{
+  int i;
+
+  if (stripe_running)
+    stripe_end(member_count);
+  stripe_running = 0;
+
+  for (i = 0; i < member_count; ++i)
+    backend->close(&members[i]);
+  member_count = 1;
+}
 
 /******************************************************************************/
 int make_disk(char *name)
-{ 
-  int f, cnt;
-  char buf[BLOCK_SIZE];
+{
+  return make_disk_geometry(name, DISK_BLOCKS, BLOCK_SIZE);
+}
+
+int make_disk_geometry(char *name, int blocks, int size)
+{
+  struct disk_trailer t = { TRAILER_MAGIC, blocks, size, 1 };
+  char *names[MAX_MEMBERS];
+  size_t bytes = (size_t) blocks * size, len = 0;
+  int i, n, result = 0;
 
   if (!name) {
     fprintf(stderr, "make_disk: invalid file name\n");
     return -1;
   }
 
-  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
-    perror("make_disk: cannot open file");
+  if (check_geometry("make_disk", blocks, size) < 0)
     return -1;
+
+  if (next_checksums) {
+    len = sizeof(t);
+    bytes += (size_t) blocks * sizeof(uint32_t) + len;
   }
 
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-    write(f, buf, BLOCK_SIZE);
+  if (!strchr(name, ','))
+    return backends[next_backend].create(name, bytes, (char *) &t, len);
 
-  close(f);
+  if ((n = split_names("make_disk", name, names)) < 0)
+    return -1;
 
-  return 0;
+  /* each image ends with the part of the trailer that is striped onto it     */
+  for (i = 0; (i < n) && !result; ++i) {
+    size_t start = bytes - len, off, from = 0, to = 0;
+
+    for (off = start; off < bytes; off = (off / STRIPE_BYTES + 1) * STRIPE_BYTES)
+      if (off / STRIPE_BYTES % n == (size_t) i) {
+        from = off - start;
+        to = (off / STRIPE_BYTES + 1) * STRIPE_BYTES - start;
+        if (to > len)
+          to = len;
+      }
+    result = backends[next_backend].create(names[i], member_bytes(bytes, i, n),
+                                           (char *) &t + from, to - from);
+  }
+
+  free(names[0]);
+
+  return result;
 }
 
 int open_disk(char *name)
 {
-  int f;
-
   if (!name) {
     fprintf(stderr, "open_disk: invalid file name\n");
     return -1;
-  }  
-  
+  }
+
   if (active) {
     fprintf(stderr, "open_disk: disk is already open\n");
     return -1;
   }
-  
-  if ((f = open(name, O_RDWR, 0644)) < 0) {
-    perror("open_disk: cannot open file");
+
+  if (open_images(name) < 0) {
+    backend = NULL;
+    return -1;
+  }
+
+  if (csum_open() < 0) {
+    close_images();
+    backend = NULL;
     return -1;
   }
 
-  handle = f;
   active = 1;
+  disk_blocks = DISK_BLOCKS;            /* until disk_set_geometry says more  */
+  block_size = BLOCK_SIZE;
+  if (csums && ((off_t) DEFAULT_BYTES > csum_off))
+    disk_blocks = csum_off / BLOCK_SIZE;
+  else if (!csums && backend->ptr && ((size_t) image_bytes() < DEFAULT_BYTES))
+    disk_blocks = image_bytes() / BLOCK_SIZE;
+  csum_active = csums && (disk_blocks == csum_blocks) && (block_size == csum_size);
+
+  if (csums && (csum_mark(0) < 0)) {
+    close_disk();
+    return -1;
+  }
+
+  return 0;
+}
+
+int disk_set_geometry(int blocks, int size)
+{
+  if (!active) {
+    fprintf(stderr, "disk_set_geometry: disk not active\n");
+    return -1;
+  }
+
+  if (check_geometry("disk_set_geometry", blocks, size) < 0)
+    return -1;
+
+  if ((backend->ptr && ((off_t) blocks * size > image_bytes())) ||
+      (csums && ((off_t) blocks * size > csum_off))) {
+    fprintf(stderr, "disk_set_geometry: disk image too small\n");
+    return -1;
+  }
+
+  disk_blocks = blocks;
+  block_size = size;
+  csum_active = csums && (blocks == csum_blocks) && (size == csum_size);
 
   return 0;
 }
 
 int close_disk()
 {
+  int result = 0;
+
   if (!active) {
     fprintf(stderr, "close_disk: no open disk\n");
     return -1;
   }
-  
-  close(handle);
 
-  active = handle = 0;
+  disk_scrub_wait();
+  io_stop();
+  if (csums && csum_active)     /* else written without keeping the table     */
+    result = csum_mark(1);
+  close_images();
+
+  active = 0;
+  backend = NULL;
+  free(csums);
+  csums = NULL;
+  free(csum_unsure);
+  csum_unsure = NULL;
+  csum_active = 0;
+
+  return result;
+}
+
+/******************************************************************************/
+/* move count blocks between consecutive disk blocks and the buffers bufs[]   */
+static int vector_io(int write, int block, char **bufs, int count)
+{
+  struct iovec iov[IOV_MAX];
+  off_t off = (off_t) block * block_size;
+
+  while (count > 0) {
+    int n = count < IOV_MAX ? count : IOV_MAX;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+      iov[i].iov_base = bufs[i];
+      iov[i].iov_len = block_size;
+    }
+    if (image_io(write, iov, n, off) < 0)
+      return -1;
+
+    off += (off_t) n * block_size;
+    bufs += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static int check_range(const char *who, int block, int count)
+{
+  if (!active) {
+    fprintf(stderr, "%s: disk not active\n", who);
+    return -1;
+  }
+
+  if ((block < 0) || (count < 0) || (count > disk_blocks - block)) {
+    fprintf(stderr, "%s: block index out of bounds\n", who);
+    return -1;
+  }
 
   return 0;
 }
 
+/******************************************************************************/
 int block_write(int block, char *buf)
 {
+  int result = 0;
+
+  if (check_range("block_write", block, 1) < 0)
+    return -1;
+
+  csum_lock(block, 1, 1, 1);
+  if ((image_write(buf, block_size, (off_t) block * block_size) < 0) ||
+      (csum_store(block, 1, buf, NULL) < 0)) {
+    perror("block_write: failed to write");
+    result = -1;
+  }
+  csum_lock(block, 1, 1, 0);
+
+  return result;
+}
+
+int block_read(int block, char *buf)
+{
+  int result = 0;
+
+  if (check_range("block_read", block, 1) < 0)
+    return -1;
+
+  csum_lock(block, 1, 0, 1);
+  if (image_read(buf, block_size, (off_t) block * block_size) < 0) {
+    perror("block_read: failed to read");
+    result = -1;
+  } else
+    result = csum_check("block_read", block, 1, buf, NULL);
+  csum_lock(block, 1, 0, 0);
+
+  return result;
+}
+
+int block_write_range(int block, int count, char *buf)
+{
+  int result = 0;
+
+  if (check_range("block_write_range", block, count) < 0)
+    return -1;
+
+  csum_lock(block, count, 1, 1);
+  if ((image_write(buf, (size_t) count * block_size, (off_t) block * block_size) < 0) ||
+      (csum_store(block, count, buf, NULL) < 0)) {
+    perror("block_write_range: failed to write");
+    result = -1;
+  }
+  csum_lock(block, count, 1, 0);
+
+  return result;
+}
+
+int block_read_range(int block, int count, char *buf)
+{
+  int result = 0;
+
+  if (check_range("block_read_range", block, count) < 0)
+    return -1;
+
+  csum_lock(block, count, 0, 1);
+  if (image_read(buf, (size_t) count * block_size, (off_t) block * block_size) < 0) {
+    perror("block_read_range: failed to read");
+    result = -1;
+  } else
+    result = csum_check("block_read_range", block, count, buf, NULL);
+  csum_lock(block, count, 0, 0);
+
+  return result;
+}
+
+int block_writev(int block, char **bufs, int count)
+{
+  int result = 0;
+
+  if (check_range("block_writev", block, count) < 0)
+    return -1;
+
+  csum_lock(block, count, 1, 1);
+  if ((vector_io(1, block, bufs, count) < 0) ||
+      (csum_store(block, count, NULL, bufs) < 0)) {
+    perror("block_writev: failed to write");
+    result = -1;
+  }
+  csum_lock(block, count, 1, 0);
+
+  return result;
+}
+
+int block_readv(int block, char **bufs, int count)
+{
+  int result = 0;
+
+  if (check_range("block_readv", block, count) < 0)
+    return -1;
+
+  csum_lock(block, count, 0, 1);
+  if (vector_io(0, block, bufs, count) < 0) {
+    perror("block_readv: failed to read");
+    result = -1;
+  } else
+    result = csum_check("block_readv", block, count, NULL, bufs);
+  csum_lock(block, count, 0, 0);
+
+  return result;
+}
+
+int block_discard(int block, int count)
+{
+  int result = 0;
+
+  if (check_range("block_discard", block, count) < 0)
+    return -1;
+
+  csum_lock(block, count, 1, 1);
+  if (csum_active) {                    /* a hole has no checksum to match    */
+    int i;
+    for (i = 0; i < count; ++i) {
+      __atomic_store_n(&csums[block + i], 0, __ATOMIC_RELAXED);
+      if (csum_unsure)
+        csum_unsure[block + i] = 0;
+    }
+    if (csum_write(block, count) < 0) {
+      perror("block_discard: failed to write");
+      result = -1;
+    }
+  }
+
+  if (!result && backend->discard &&
+      (image_discard((size_t) count * block_size, (off_t) block * block_size) < 0)) {
+    perror("block_discard: failed to discard");
+    result = -1;
+  }
+  csum_lock(block, count, 1, 0);
+
+  return result;
+}
+
+int disk_flush()
+{
+  int i;
+
   if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
+    fprintf(stderr, "disk_flush: no open disk\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
+  if (!backend->sync)
+    return 0;
+
+  for (i = 0; i < member_count; ++i)
+    if (backend->sync(&members[i]) < 0) {
+      perror("disk_flush: failed to flush");
+      return -1;
+    }
+
+  return 0;
+}
+
+char *block_ptr(int block)
+{
+  char *p;
+  int result;
+
+  if (!active || (block < 0) || (block >= disk_blocks) ||
+      !(p = image_ptr((off_t) block * block_size, block_size)))
+    return NULL;
+
+  csum_lock(block, 1, 0, 1);
+  result = csum_check("block_ptr", block, 1, p, NULL);
+  csum_lock(block, 1, 0, 0);
+
+  return result < 0 ? NULL : p;
+}
+
+/* read-only view of count blocks: the image itself on backends that keep it */
+/* in memory, else a shared mapping of the image file; NULL if the blocks do  */
+/* not start on a page boundary of the file, are spread over several images   */
+/* of a volume or fail their checksums                                        */
+char *block_map(int block, int count)
+{
+  off_t off = (off_t) block * block_size, moff;
+  struct member *m;
+  char *p;
+  int result;
+
+  if ((check_range("block_map", block, count) < 0) || (count == 0))
+    return NULL;
+
+  if (backend->ptr) {
+    if (!(p = image_ptr(off, (size_t) count * block_size)))
+      return NULL;
+  } else if (!(m = image_member(off, (size_t) count * block_size, &moff)) ||
+             (moff % sysconf(_SC_PAGESIZE)))
+    return NULL;
+  else if ((p = mmap(NULL, (size_t) count * block_size, PROT_READ, MAP_SHARED,
+                     m->handle, moff)) == MAP_FAILED)
+    return NULL;
+
+  csum_lock(block, count, 0, 1);
+  result = csum_check("block_map", block, count, p, NULL);
+  csum_lock(block, count, 0, 0);
+  if (result < 0) {
+    block_unmap(p, count);
+    return NULL;
+  }
+
+  return p;
+}
+
+int block_unmap(char *p, int count)
+{
+  if (!active) {
+    fprintf(stderr, "block_unmap: disk not active\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
+  if (!backend->ptr && (munmap(p, (size_t) count * block_size) < 0)) {
+    perror("block_unmap: failed to unmap");
     return -1;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
+  return 0;
+}
+
+/******************************************************************************/
+/* Asynchronous I/O. Submitted requests wait in a queue sorted by block       */
+/* number. I/O threads serve it like an elevator sweeping up the disk: each   */
+/* takes the first request at or after the block the last transfer ended at  */
+/* (going back to the start at the end), together with the requests that     */
+/* follow on from it in the same direction, and moves them all as one        */
+/* vectored transfer.                                                         */
+
+static int io_find(int block)   /* first queued request at or after block     */
+{
+  int lo = 0, hi = io_queue_len;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (io_queue[mid]->block < block)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static int compare_requests(const void *a, const void *b)
+{
+  const struct disk_request *x = *(struct disk_request * const *) a;
+  const struct disk_request *y = *(struct disk_request * const *) b;
+
+  if (x->block != y->block)
+    return x->block < y->block ? -1 : 1;
+  return x < y ? -1 : (x > y);  /* requests of one submission are an array   */
+}
+
+/* run the n requests of batch, which cover adjacent blocks, as one transfer; */
+/* if that fails each is run alone, so that only the bad ones report it       */
+static void io_run(struct disk_request **batch, int n)
+{
+  char *bufs[IO_MERGE_BLOCKS];
+  int i, j, blocks = 0, result;
+
+  if (n == 1)
+    result = batch[0]->write ? block_write_range(batch[0]->block, batch[0]->count, batch[0]->buf)
+                             : block_read_range(batch[0]->block, batch[0]->count, batch[0]->buf);
+  else {
+    for (i = 0; i < n; ++i)
+      for (j = 0; j < batch[i]->count; ++j)
+        bufs[blocks++] = batch[i]->buf + (size_t) j * block_size;
+    result = batch[0]->write ? block_writev(batch[0]->block, bufs, blocks)
+                             : block_readv(batch[0]->block, bufs, blocks);
+  }
+
+  for (i = 0; i < n; ++i) {
+    struct disk_request *req = batch[i];
+    if ((result < 0) && (n > 1))
+      req->result = req->write ? block_write_range(req->block, req->count, req->buf)
+                               : block_read_range(req->block, req->count, req->buf);
+    else
+      req->result = result;
+  }
+}
+
+static void *io_worker(void *arg)
+{
+  struct disk_request *batch[IO_MERGE_BLOCKS];
+  int notify[IO_MERGE_BLOCKS];  /* has a done callback, which may free it     */
+  int i, n, blocks, end;
+
+  (void) arg;
+  pthread_mutex_lock(&io_lock);
+  for (;;) {
+    while (!io_queue_len && !io_stop_flag)
+      pthread_cond_wait(&io_work, &io_lock);
+    if (!io_queue_len)
+      break;                    /* stopping, and nothing is left to do        */
+
+    i = io_find(io_head);
+    if (i == io_queue_len)
+      i = 0;
+
+    batch[0] = io_queue[i];
+    end = batch[0]->block + batch[0]->count;
+    blocks = batch[0]->count;
+    for (n = 1; i + n < io_queue_len; ++n) {
+      struct disk_request *next = io_queue[i + n];
+      if ((next->block != end) || (next->write != batch[0]->write) ||
+          (blocks + next->count > IO_MERGE_BLOCKS))
+        break;
+      batch[n] = next;
+      end += next->count;
+      blocks += next->count;
+    }
+    memmove(io_queue + i, io_queue + i + n, (io_queue_len - i - n) * sizeof(*io_queue));
+    io_queue_len -= n;
+    io_head = end;
+    pthread_mutex_unlock(&io_lock);
+
+    for (i = 0; i < n; ++i)
+      notify[i] = batch[i]->done != NULL;
+    io_run(batch, n);
+    for (i = 0; i < n; ++i)     /* a request is not touched after its done    */
+      if (notify[i])
+        batch[i]->done(batch[i]);
+
+    pthread_mutex_lock(&io_lock);
+    for (i = 0; i < n; ++i)
+      if (!notify[i])
+        batch[i]->finished = 1;
+    io_pending -= n;
+    pthread_cond_broadcast(&io_idle);
+  }
+  pthread_mutex_unlock(&io_lock);
+
+  return NULL;
+}
+
+/* wait for everything queued, then let the I/O threads go                    */
+static void io_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&io_lock);
+  while (io_pending)
+    pthread_cond_wait(&io_idle, &io_lock);
+  io_stop_flag = 1;
+  pthread_cond_broadcast(&io_work);
+  pthread_mutex_unlock(&io_lock);
+
+  for (i = 0; i < io_running; ++i)
+    pthread_join(io_workers[i], NULL);
+
+  io_running = 0;
+  io_stop_flag = 0;
+  free(io_queue);
+  io_queue = NULL;
+  io_queue_len = io_queue_cap = 0;
+}
+
+int block_submit(struct disk_request *reqs, int count)
+{
+  int i;
+
+  for (i = 0; i < count; ++i)
+    if (check_range("block_submit", reqs[i].block, reqs[i].count) < 0)
+      return -1;
+
+  pthread_mutex_lock(&io_lock);
+  if (2 * count + io_queue_len > io_queue_cap) {
+    int cap = io_queue_cap ? io_queue_cap : 64;
+    struct disk_request **queue;
+    while (cap < 2 * count + io_queue_len)
+      cap *= 2;
+    if (!(queue = realloc(io_queue, cap * sizeof(*queue)))) {
+      pthread_mutex_unlock(&io_lock);
+      fprintf(stderr, "block_submit: out of memory\n");
+      return -1;
+    }
+    io_queue = queue;
+    io_queue_cap = cap;
+  }
+
+  while (io_running < io_threads) {
+    if (pthread_create(&io_workers[io_running], NULL, io_worker, NULL)) {
+      if (io_running)
+        break;                  /* make do with the threads there are         */
+      pthread_mutex_unlock(&io_lock);
+      fprintf(stderr, "block_submit: cannot start I/O thread\n");
+      return -1;
+    }
+    ++io_running;
+  }
+
+  /* sort the new requests, then merge them in from the back of the queue;   */
+  /* requests for the same block stay in the order they came in              */
+  for (i = 0; i < count; ++i) {
+    reqs[i].finished = 0;
+    reqs[i].result = 0;
+    io_queue[io_queue_cap - count + i] = &reqs[i];
+  }
+  qsort(io_queue + io_queue_cap - count, count, sizeof(*io_queue), compare_requests);
+  {
+    struct disk_request **old = io_queue + io_queue_len - 1;
+    struct disk_request **add = io_queue + io_queue_cap - 1;
+    struct disk_request **to = io_queue + io_queue_len + count - 1;
+    while (add >= io_queue + io_queue_cap - count) {
+      if ((old >= io_queue) && ((*old)->block > (*add)->block))
+        *to-- = *old--;
+      else
+        *to-- = *add--;
+    }
+  }
+  io_queue_len += count;
+  io_pending += count;
+  pthread_cond_broadcast(&io_work);
+  pthread_mutex_unlock(&io_lock);
+
+  return 0;
+}
+
+int disk_request_wait(struct disk_request *req)
+{
+  pthread_mutex_lock(&io_lock);
+  while (!req->finished)
+    pthread_cond_wait(&io_idle, &io_lock);
+  pthread_mutex_unlock(&io_lock);
+
+  return req->result;
+}
+
+int disk_wait_all()
+{
+  pthread_mutex_lock(&io_lock);
+  while (io_pending)
+    pthread_cond_wait(&io_idle, &io_lock);
+  pthread_mutex_unlock(&io_lock);
+
+  return 0;
+}
+
+int disk_set_io_threads(int threads)
+{
+  if ((threads < 1) || (threads > MAX_IO_THREADS)) {
+    fprintf(stderr, "disk_set_io_threads: between 1 and %d threads\n", MAX_IO_THREADS);
     return -1;
   }
 
+  io_stop();                    /* the next submission starts the new number  */
+  io_threads = threads;
+
   return 0;
 }
 
-int block_read(int block, char *buf)
+/******************************************************************************/
+/* Scrubbing reads every block that has a checksum and compares. Worker       */
+/* threads claim chunks of blocks through a shared counter, and read each     */
+/* under the checksum locks, so no write can come between a block and its     */
+/* entry: a mismatch is real the first time it is seen.                       */
+
+struct scrub {
+  int next;                     /* first block of the next unclaimed chunk    */
+  int chunk;
+  int bad;
+};
+
+static void *scrub_worker(void *arg)
+{
+  struct scrub *sc = arg;
+  char *buf = malloc((size_t) sc->chunk * block_size);
+  int first, i, n;
+
+  if (!buf) {
+    __atomic_store_n(&sc->bad, -1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  while ((first = __atomic_fetch_add(&sc->next, sc->chunk, __ATOMIC_RELAXED)) < disk_blocks) {
+    n = disk_blocks - first < sc->chunk ? disk_blocks - first : sc->chunk;
+    csum_lock(first, n, 0, 1);
+    if (image_read(buf, (size_t) n * block_size, (off_t) first * block_size) < 0) {
+      csum_lock(first, n, 0, 0);
+      __atomic_store_n(&sc->bad, -1, __ATOMIC_RELAXED);
+      break;
+    }
+    for (i = 0; i < n; ++i)
+      if (csum_verify(first + i, buf + (size_t) i * block_size) < 0) {
+        fprintf(stderr, "disk_scrub: checksum mismatch in block %d\n", first + i);
+        __atomic_fetch_add(&sc->bad, 1, __ATOMIC_RELAXED);
+      }
+    csum_lock(first, n, 0, 0);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+int disk_scrub(int threads)
 {
+  pthread_t tids[MAX_SCRUB_THREADS];
+  struct scrub sc;
+  int i, started;
+
   if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
+    fprintf(stderr, "disk_scrub: disk not active\n");
     return -1;
   }
 
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
+  if (!csum_active)
+    return 0;                   /* nothing to check against                   */
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  if (threads > MAX_SCRUB_THREADS)
+    threads = MAX_SCRUB_THREADS;
+
+  sc.next = 0;
+  sc.chunk = SCRUB_CHUNK * BLOCK_SIZE / block_size;
+  if (sc.chunk < 1)
+    sc.chunk = 1;
+  sc.bad = 0;
+
+  for (started = 0; started < threads; ++started)
+    if (pthread_create(&tids[started], NULL, scrub_worker, &sc))
+      break;
+  if (!started)
+    scrub_worker(&sc);          /* no threads to be had: scrub right here     */
+  for (i = 0; i < started; ++i)
+    pthread_join(tids[i], NULL);
+
+  return sc.bad;
+}
+
+static void *scrub_main(void *arg)
+{
+  (void) arg;
+  scrub_result = disk_scrub(scrub_threads);
+  return NULL;
+}
+
+int disk_scrub_start(int threads)
+{
+  if (!active) {
+    fprintf(stderr, "disk_scrub_start: disk not active\n");
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  if (scrub_running) {
+    fprintf(stderr, "disk_scrub_start: scrub already running\n");
     return -1;
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
+  scrub_threads = threads;
+  if (pthread_create(&scrubber, NULL, scrub_main, NULL)) {
+    fprintf(stderr, "disk_scrub_start: cannot start thread\n");
     return -1;
   }
+  scrub_running = 1;
+
+  return 0;
+}
+
+int disk_scrub_wait()
+{
+  if (!scrub_running)
+    return -1;
+
+  pthread_join(scrubber, NULL);
+  scrub_running = 0;
+
+  return scrub_result;
+}
+
+int disk_set_checksums(int on)
+{
+  next_checksums = on != 0;
 
   return 0;
-}
\ No newline at end of file
+}
+
+void *disk_buffer(size_t len)
+{
+  void *p;
+
+  if (posix_memalign(&p, DIRECT_ALIGN, len ? len : 1))
+    return NULL;
+
+  memset(p, 0, len);
+
+  return p;
+}
@@ -1,19 +1,97 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <stddef.h>
+
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
+#define DISK_BLOCKS  8192      /* number of blocks on a default disk          */
+#define BLOCK_SIZE   4096      /* block size of a default disk                */
+
+#define DISK_FILE    0         /* image file, read and written with pread etc */
+#define DISK_MMAP    1         /* image file mapped into memory               */
+#define DISK_RAM     2         /* image kept in process memory only           */
+#define DISK_DIRECT  3         /* image file, read and written with O_DIRECT  */
+                               /* so that it is not cached by the host too    */
 
 /******************************************************************************/
+int disk_set_backend(int type);/* backend used by the next make/open_disk     */
 int make_disk(char *name);     /* create an empty, virtual disk file          */
+int make_disk_geometry(char *name, int blocks, int size);
+                               /* same, with blocks blocks of size bytes      */
 int open_disk(char *name);     /* open a virtual disk (file)                  */
+                               /* names may list several images separated by  */
+                               /* commas ("a.img,b.img") for a volume striped */
+                               /* over them in 64K pieces, each image served  */
+                               /* by its own I/O thread; make_disk makes one  */
 int close_disk();              /* close a previously opened disk (file)       */
+int disk_set_geometry(int blocks, int size);
+                               /* geometry of the open disk; until this is    */
+                               /* called it is DISK_BLOCKS x BLOCK_SIZE       */
 
 int block_write(int block, char *buf);
-                               /* write a block of size BLOCK_SIZE to disk    */
+                               /* write a block of the disk's block size      */
 int block_read(int block, char *buf);
-                               /* read a block of size BLOCK_SIZE from disk   */
+                               /* read a block of the disk's block size       */
+int block_write_range(int block, int count, char *buf);
+                               /* write count adjacent blocks from one buffer */
+int block_read_range(int block, int count, char *buf);
+                               /* read count adjacent blocks into one buffer  */
+int block_writev(int block, char **bufs, int count);
+                               /* write count adjacent blocks, gathering each */
+                               /* block from its own buffer in bufs[]         */
+int block_readv(int block, char **bufs, int count);
+                               /* read count adjacent blocks, scattering each */
+                               /* block into its own buffer in bufs[]         */
+int block_discard(int block, int count);
+                               /* the count blocks at block hold nothing any  */
+                               /* more; they may read back as zeros           */
+int disk_flush();              /* wait until every block written so far is on */
+                               /* stable storage, so it survives a crash      */
+char *block_ptr(int block);    /* address of a block's contents on backends   */
+                               /* that hold the image in memory, else NULL    */
+char *block_map(int block, int count);
+                               /* read-only view of count adjacent blocks,    */
+                               /* NULL where the backend cannot give one      */
+int block_unmap(char *p, int count);
+                               /* done with a view from block_map             */
+void *disk_buffer(size_t len); /* len zeroed bytes aligned for direct I/O, to */
+                               /* be freed with free(); DISK_DIRECT has to    */
+                               /* copy through other buffers                  */
+
+/* Asynchronous I/O: requests are queued, sorted by block number and served */
+/* by I/O threads, which merge requests for adjacent blocks into one         */
+/* transfer. Requests overlapping others in flight finish in no set order.   */
+struct disk_request {
+  int write;                   /* 1 to write buf to the disk, 0 to read it    */
+  int block;                   /* first of count adjacent blocks              */
+  int count;
+  char *buf;                   /* count blocks of the disk's block size       */
+  void (*done)(struct disk_request *req);
+                               /* called on an I/O thread once req finished;  */
+                               /* NULL to use disk_request_wait instead       */
+  void *arg;                   /* for the caller                              */
+  int result;                  /* 0 or -1, once finished                      */
+  int finished;                /* set when a request without done finished    */
+};
+
+int block_submit(struct disk_request *reqs, int count);
+                               /* queue count requests; they must stay put    */
+                               /* until finished                              */
+int disk_request_wait(struct disk_request *req);
+                               /* wait for a request, return its result       */
+int disk_wait_all();           /* wait for every request submitted so far     */
+int disk_set_io_threads(int threads);
+                               /* I/O threads serving the queue (default 2)   */
+
+int disk_set_checksums(int on);/* keep a CRC32C of every block in disks made  */
+                               /* from now on (the default), checked on reads */
+                               /* (after a crash, blocks not matching theirs  */
+                               /* are taken as written just before it)        */
+int disk_scrub(int threads);   /* check every block with threads threads (0:  */
+                               /* one per CPU); returns the number found bad  */
+int disk_scrub_start(int threads);
+                               /* same, in the background while I/O goes on   */
+int disk_scrub_wait();         /* wait for that scrub and return its result   */
 /******************************************************************************/
 
 #endif
\ No newline at end of file
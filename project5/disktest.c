@@ -0,0 +1,243 @@
+// Checks of the disk layer on its own, without a file system. Build it with
+// -fsanitize=address as well to catch requests used after they were freed.
+// Prints what failed and exits with 1, or prints "ok".
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "disk.h"
+
+#define TEST_BLOCKS 1024
+#define RACE_WRITES 2000
+#define SMALL_BLOCK 512
+#define SECTOR_BLOCKS 8 // small blocks in one 4K unit of direct I/O
+
+// Where make_disk puts the block data and the clean flag of the trailer.
+#define IMAGE_BYTES ((off_t) DISK_BLOCKS * BLOCK_SIZE + (off_t) DISK_BLOCKS * 4 + 16)
+#define CLEAN_OFFSET (IMAGE_BYTES - 4)
+
+static char *disk_name = "disktest.img";
+static int completed = 0; // requests whose done callback ran
+
+static int fail(const char *what) {
+    printf("FAIL %s\n", what);
+    return 1;
+}
+
+// The usual way to fire and forget: the callback frees its own request.
+static void free_request(struct disk_request *req) {
+    if (req->result < 0) {
+        printf("FAIL async write of block %d\n", req->block);
+        exit(1);
+    }
+    __atomic_add_fetch(&completed, 1, __ATOMIC_RELAXED);
+    free(req->buf);
+    free(req);
+}
+
+// Adjacent single-block writes, so the I/O threads merge them into batches
+// whose requests all free themselves.
+static int test_done_frees_request(void) {
+    char buf[BLOCK_SIZE];
+    int i;
+
+    completed = 0;
+    for (i = 0; i < TEST_BLOCKS; i++) {
+        struct disk_request *req = calloc(1, sizeof(*req));
+        if (!req || !(req->buf = malloc(BLOCK_SIZE))) {
+            return fail("out of memory");
+        }
+        memset(req->buf, i % 251, BLOCK_SIZE);
+        req->write = 1;
+        req->block = i;
+        req->count = 1;
+        req->done = free_request;
+        if (block_submit(req, 1) < 0) {
+            return fail("block_submit");
+        }
+    }
+    disk_wait_all();
+    if (completed != TEST_BLOCKS) {
+        return fail("not every done callback ran");
+    }
+    for (i = 0; i < TEST_BLOCKS; i++) {
+        if (block_read(i, buf) < 0 || buf[0] != (char) (i % 251) || buf[BLOCK_SIZE - 1] != (char) (i % 251)) {
+            return fail("async write did not reach the disk");
+        }
+    }
+    return 0;
+}
+
+// Overwrite block behind the disk layer's back, as a crash between a block
+// and its checksum would leave it, and set the clean flag of the trailer.
+static int patch_image(int block, char fill, int clean) {
+    char buf[BLOCK_SIZE];
+    int fd = open(disk_name, O_WRONLY);
+    int32_t flag = clean;
+    int result = 0;
+
+    if (fd < 0) {
+        return -1;
+    }
+    memset(buf, fill, BLOCK_SIZE);
+    if (pwrite(fd, buf, BLOCK_SIZE, (off_t) block * BLOCK_SIZE) != BLOCK_SIZE ||
+        pwrite(fd, &flag, sizeof(flag), CLEAN_OFFSET) != sizeof(flag)) {
+        result = -1;
+    }
+    close(fd);
+    return result;
+}
+
+// After an unclean close a block that does not match its checksum is read
+// and adopted; after a clean one it is still reported.
+static int test_unclean_close(void) {
+    char buf[BLOCK_SIZE];
+
+    memset(buf, 'a', BLOCK_SIZE);
+    if (block_write(5, buf) < 0 || block_write(6, buf) < 0) {
+        return fail("block_write");
+    }
+    close_disk();
+
+    if (patch_image(5, 'b', 0) < 0 || open_disk(disk_name) < 0) {
+        return fail("cannot reopen after an unclean close");
+    }
+    if (block_read(5, buf) < 0 || buf[0] != 'b') {
+        return fail("block written just before a crash is unreadable");
+    }
+    if (disk_scrub(2) != 0) {
+        return fail("scrub after an unclean close");
+    }
+    close_disk();
+
+    if (patch_image(6, 'c', 1) < 0 || open_disk(disk_name) < 0) {
+        return fail("cannot reopen after a clean close");
+    }
+    if (block_read(5, buf) < 0 || buf[0] != 'b') {
+        return fail("adopted checksum was not kept");
+    }
+    if (block_read(6, buf) == 0) {
+        return fail("corrupt block read after a clean close");
+    }
+    if (disk_scrub(2) != 1) {
+        return fail("scrub missed a corrupt block");
+    }
+    memset(buf, 'a', BLOCK_SIZE);
+    if (block_write(6, buf) < 0) {
+        return fail("block_write");
+    }
+    return 0;
+}
+
+static void *race_writer(void *arg) {
+    char buf[BLOCK_SIZE];
+    int i;
+
+    memset(buf, (int) (long) arg, BLOCK_SIZE);
+    for (i = 0; i < RACE_WRITES; i++) {
+        if (block_write(i % 8, buf) < 0) {
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
+
+// Writers racing on the same blocks must never leave one's data with the
+// other's checksum, and readers and scrubs must never see them apart.
+static int test_racing_writers(void) {
+    pthread_t tids[2];
+    char buf[BLOCK_SIZE];
+    void *bad[2];
+    int i, failed = 0;
+
+    if (disk_scrub_start(2) < 0) {
+        return fail("disk_scrub_start");
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_create(&tids[i], NULL, race_writer, (void *) (long) ('x' + i));
+    }
+    for (i = 0; i < RACE_WRITES; i++) {
+        failed |= block_read(i % 8, buf) < 0;
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(tids[i], &bad[i]);
+    }
+    if (failed || bad[0] || bad[1] || disk_scrub_wait() != 0) {
+        return fail("racing writes");
+    }
+    for (i = 0; i < 8; i++) {
+        if (block_read(i, buf) < 0) {
+            return fail("checksum of a raced block");
+        }
+    }
+    return 0;
+}
+
+static void *small_writer(void *arg) {
+    char buf[SMALL_BLOCK];
+    int i;
+
+    for (i = 0; i < RACE_WRITES; i++) {
+        memset(buf, i, SMALL_BLOCK);
+        if (block_write(0, buf) < 0) {
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
+
+// With blocks smaller than the unit of direct I/O, a write of one block
+// rewrites its whole unit; an aligned write of the rest of that unit made
+// meanwhile must not be undone by it.
+static int test_direct_small_blocks(void) {
+    char *unit = disk_buffer(SMALL_BLOCK * SECTOR_BLOCKS);
+    char buf[SMALL_BLOCK];
+    pthread_t tid;
+    void *bad;
+    int i, j, failed = 0;
+
+    disk_set_backend(DISK_DIRECT);
+    disk_set_checksums(0); // their locks would keep the writes apart anyway
+    if (!unit || make_disk_geometry(disk_name, DISK_BLOCKS, SMALL_BLOCK) < 0 ||
+        open_disk(disk_name) < 0 || disk_set_geometry(DISK_BLOCKS, SMALL_BLOCK) < 0) {
+        free(unit);
+        return fail("cannot make a direct disk of small blocks");
+    }
+    pthread_create(&tid, NULL, small_writer, NULL);
+    for (i = 0; i < RACE_WRITES && !failed; i++) {
+        memset(unit, 'A' + i % 26, SMALL_BLOCK * SECTOR_BLOCKS);
+        failed |= block_write_range(0, SECTOR_BLOCKS, unit) < 0;
+        for (j = 1; j < SECTOR_BLOCKS && !failed; j++) {
+            failed |= block_read(j, buf) < 0 || buf[0] != 'A' + i % 26;
+        }
+    }
+    pthread_join(tid, &bad);
+    close_disk();
+    disk_set_checksums(1);
+    disk_set_backend(DISK_FILE);
+    free(unit);
+    if (failed || bad) {
+        return fail("small block write undid an aligned one");
+    }
+    return 0;
+}
+
+int main(void) {
+    int failed = 0;
+
+    if (make_disk(disk_name) < 0 || open_disk(disk_name) < 0) {
+        return fail("cannot make the disk");
+    }
+    failed |= test_done_frees_request();
+    failed |= test_unclean_close();
+    failed |= test_racing_writers();
+    close_disk();
+    failed |= test_direct_small_blocks();
+    unlink(disk_name);
+    if (!failed) {
+        printf("ok\n");
+    }
+    return failed;
+}
@@ -1,13 +1,30 @@
+#define _GNU_SOURCE // for mremap
 #include "disk.h"
+#include "fs.h"
 #include <string.h>  // For memset, strcmp, strlen, strcpy
 #include <stddef.h> 
 #include <stdbool.h>
-#include <stdlib.h> // For malloc
+#include <stdlib.h> // For malloc, qsort
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #define MAX_F_NAME 15
 #define MAX_FILDES 32
-#define MAX_FILES 64
+#define MAX_FILES 32768 // most directory slots make_fs gives a disk, the root directory included
 #define MAX_FILE_SIZE 16
+#define DEFAULT_CACHE_BYTES (256 * 1024) // buffer cache size unless fs_set_cache_size says otherwise
+#define JOURNAL_BYTES (128 * 1024) // size of the metadata journal made by make_fs
+#define JOURNAL_GROUP_RECORDS 256 // pending metadata changes that force a group commit
+#define JOURNAL_HIGH_WATER 50 // percent of the journal in use that makes a commit checkpoint
+#define JOURNAL_MAGIC 0x4a524e4c
+#define READAHEAD_MIN_BLOCKS 4 // first readahead window of a sequential reader
+#define READAHEAD_MAX_BLOCKS 64 // the window doubles up to this, or half the cache
+#define ZCLUSTER_BYTES (64 * 1024) // file data per compressed frame, or one block if bigger
 
 struct super_block {
     int fat_idx; // First block of the FAT
@@ -15,473 +32,4435 @@ struct super_block {
     int dir_idx; // First block of directory
     int dir_len; // Length of directory in blocks
     int data_idx; // First block of file-data
+    int journal_idx; // First block of the metadata journal
+    int journal_len; // Length of the journal in blocks, 0 if there is none
+    int journal_seq; // Sequence number of the group expected at journal_idx
+    int block_size; // Bytes per block
+    int disk_blocks; // Blocks on the disk, these included
 };
 
+#define DIR_FILE 1 // values of dir_entry.used
+#define DIR_DIRECTORY 2
+#define ROOT_DIR 0 // slot of the root directory
+#define DIR_INLINE_BYTES 24 // largest file kept in its directory entry
+
 struct dir_entry {
-    int used; // Is this file-”slot” in use
+    int used; // Is this file-”slot” in use: 0, DIR_FILE or DIR_DIRECTORY
     char name [MAX_F_NAME + 1]; // DOH!
-    int size; // file size
     int head; // first data block of file
-    int ref_cnt; // how many open file descriptors are there? ref_cnt > 0 -> cannot delete file
+    int64_t size; // file size
+    int parent; // slot of the directory holding this entry, -1 for the root
+    int flags; // DIR_COMPRESSED, DIR_INLINE, DIR_TAIL or 0
+    union { // zero unless the end of the file is packed; keeps entries 64 bytes
+        char data[DIR_INLINE_BYTES]; // DIR_INLINE: the file's contents
+        struct {
+            int block; // DIR_TAIL: block holding the file's last, partial block
+            int offset; // and where in it
+        } tail;
+    };
 };
 
+#define DIR_COMPRESSED 1 // dir_entry.flags: data is stored as compressed frames
+#define DIR_INLINE 2 // the whole file is in dir_entry.data
+#define DIR_TAIL 4 // the last block is packed into a tail block shared with other files
+#define DIR_PACKED (DIR_INLINE | DIR_TAIL)
+
 struct file_descriptor {
     int is_used; // fd in use
     int file; // the first block of the file (f) to which fd refers too
-    int offset; // where in the file the fd is
+    off_t offset; // where in the file the fd is
+    int cur_block; // disk block holding logical block cur_index, -1 if unknown
+    int cur_index;
+    int cur_gen; // file_info gen the cursor was taken at
+    off_t ra_offset; // where the last read ended; a read starting here is sequential
+    int ra_window; // readahead window in blocks, 0 while reads are not sequential
+    int ra_end; // first logical block not yet handed to the prefetch thread
+    pthread_mutex_t lock; // held while a call uses this descriptor
 };
 
 struct super_block* fs;
-struct file_descriptor fildes_array[MAX_FILDES]; // 32
+struct file_descriptor fildes_array[MAX_FILDES] = { // 32
+    [0 ... MAX_FILDES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
 int* FAT; //  Array of block_idx’es (or eof, or free)
+static int block_size = BLOCK_SIZE; // geometry of the file system being made or mounted
+static int disk_blocks = DISK_BLOCKS;
+static int dir_slots = 0; // entries DIR has room for
 struct dir_entry* DIR; // Will be populated with the directory data
 int fs_mounted = 0;
 
+// Locking. fs_lock is taken shared by every public call and exclusively by
+// make_fs, mount_fs, umount_fs and fs_set_cache_size, which replace the
+// tables everything else works on. Below it, locks are always taken in this
+// order, each one optional:
+//   dir_lock         - the namespace: looking names up, creating, deleting
+//   descriptor lock  - one per fildes_array slot, for the offset and cursor
+//   file_info lock   - per file rwlock: readers share it, writing,
+//                      truncating and flushing pending data take it alone
+//   meta_lock        - the allocator, FAT and DIR updates and the journal
+//   cache_lock       - the buffer cache's own bookkeeping
+// prefetch_lock only guards the readahead queue and nests under any of them.
+// FAT entries and DIR fields of a file are only changed with its file_info
+// lock held exclusively, so they can be read under the shared lock alone.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int make_fs(char *disk_name) {
-    fs = malloc(sizeof(struct super_block));
-    FAT = malloc(DISK_BLOCKS * sizeof(int));
-    memset(FAT, 0, DISK_BLOCKS * sizeof(int));
-    DIR = malloc(MAX_FILES * sizeof(struct dir_entry));
-    memset(DIR, 0, MAX_FILES * sizeof(struct dir_entry));
+// Operation statistics for fs_stats. The counters are bumped with atomic adds
+// rather than under a lock, so that counting does not serialize the calls
+// being measured.
+static struct fs_stats stats;
 
-    if (make_disk(disk_name) < 0) {
-        return -1; // Failed to create or open the disk
-    }
+static uint64_t stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-    if (open_disk(disk_name) < 0) {
-        return -1; // Failed to open the disk
-    }
+static void stats_count(unsigned long long *counter, unsigned long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
 
-    fs->fat_idx = 1; // FAT starts at block 1
-    fs->fat_len = 8; // FAT length in blocks
-    fs->dir_idx = 9; // Directory starts after FAT
-    fs->dir_len = 1; // Directory length in blocks
-    fs->data_idx = 10; // Start at index 10
+// Buffer cache between the file system and the disk. Data blocks are kept in
+// memory and written back lazily; the least recently used block is evicted
+// (and written out if dirty) when a slot is needed. Callers pin a slot with
+// cache_get and unpin it with cache_put; disk I/O happens with cache_lock
+// dropped, with the slot marked busy so nobody else touches it meanwhile.
+struct cache_entry {
+    int block; // disk block held in this slot, -1 if the slot is empty
+    int dirty; // modified since it was read from disk
+    int pins; // callers currently using data
+    int busy; // being read from or written to disk
+    int prev; // LRU neighbours (slot indices), -1 at either end
+    int next;
+    int hnext; // next slot in the same hash bucket
+    char *data; // block_size bytes of block contents
+};
 
-    int i;
-    for(i = 0; i < DISK_BLOCKS; i++) {
-        FAT[i] = 0;
-    }
+static struct cache_entry *cache = NULL;
+static char *cache_data = NULL;
+static int *cache_buckets = NULL;
+static int cache_nbuckets = 0;
+static int cache_size = 0; // slots in cache
+static int cache_wanted = 0; // slots asked for with fs_set_cache_size, 0 for the default
+static int lru_head = -1; // most recently used
+static int lru_tail = -1; // least recently used
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER; // a slot stopped being busy or pinned
 
-    for(i = 0; i < MAX_FILES; i++) {
-        DIR[i].used = 0;
-    }
+static int cache_hash(int block) {
+    return (unsigned int) block * 2654435761u % cache_nbuckets;
+}
 
-    // write the superblock to disk
-    if (block_write(0, (char *) fs) < 0) {
-        return -1;
+static void lru_unlink(int i) {
+    if (cache[i].prev != -1) {
+        cache[cache[i].prev].next = cache[i].next;
+    } else {
+        lru_head = cache[i].next;
     }
-
-    // write the FAT and directory to disk
-    int entries_per_block = BLOCK_SIZE / sizeof(int);
-    for (i = 0; i < fs->fat_len; i++) {
-        if (block_write(fs->fat_idx + i, (char *) (FAT + i * entries_per_block)) < 0) {
-            return -1;
-        }
+    if (cache[i].next != -1) {
+        cache[cache[i].next].prev = cache[i].prev;
+    } else {
+        lru_tail = cache[i].prev;
     }
+}
 
-    entries_per_block = BLOCK_SIZE / sizeof(struct dir_entry);
-    for (i = 0; i < fs->dir_len; i++) {
-    if (block_write(fs->dir_idx + i, (char *) (DIR + i * entries_per_block)) < 0) {
-            return -1;
-        }
+static void lru_push_front(int i) {
+    cache[i].prev = -1;
+    cache[i].next = lru_head;
+    if (lru_head != -1) {
+        cache[lru_head].prev = i;
     }
-    if (close_disk() < 0) {
-        return -1; // Failed to close the disk
+    lru_head = i;
+    if (lru_tail == -1) {
+        lru_tail = i;
     }
-    return 0; // Success
 }
 
-int mount_fs(char *disk_name) {
-    if (open_disk(disk_name) < 0) {
-        return -1; // Failed to open the disk
+static void lru_push_back(int i) {
+    cache[i].prev = lru_tail;
+    cache[i].next = -1;
+    if (lru_tail != -1) {
+        cache[lru_tail].next = i;
+    } else {
+        lru_head = i;
     }
-    if (block_read(0, (char *) fs) < 0) {
-        return -1; // Failed to read the superblock
+    lru_tail = i;
+}
+
+static void hash_remove(int i) {
+    int *p = &cache_buckets[cache_hash(cache[i].block)];
+    while (*p != -1) {
+        if (*p == i) {
+            *p = cache[i].hnext;
+            return;
+        }
+        p = &cache[*p].hnext;
     }
-    FAT = malloc(DISK_BLOCKS * sizeof(int));
-    int entries_per_block = BLOCK_SIZE / sizeof(int);
+}
+
+static void hash_insert(int i) {
+    int h = cache_hash(cache[i].block);
+    cache[i].hnext = cache_buckets[h];
+    cache_buckets[h] = i;
+}
+
+static int cache_init(int nblocks) {
     int i;
-    for (i = 0; i < fs->fat_len; i++) {
-        if (block_read(fs->fat_idx + i, (char *) (FAT + i * entries_per_block)) < 0) {
-            return -1; 
-        }
+    cache = malloc(nblocks * sizeof(struct cache_entry));
+    cache_data = disk_buffer((size_t) nblocks * block_size);
+    cache_nbuckets = nblocks * 2;
+    cache_buckets = malloc(cache_nbuckets * sizeof(int));
+    if (!cache || !cache_data || !cache_buckets) {
+        free(cache);
+        free(cache_data);
+        free(cache_buckets);
+        cache = NULL;
+        cache_data = NULL;
+        cache_buckets = NULL;
+        return -1;
     }
-    DIR = malloc(MAX_FILES * sizeof(struct dir_entry));
-    entries_per_block = BLOCK_SIZE / sizeof(struct dir_entry);
-    for(i = 0; i < fs->dir_len; i++) {
-        if (block_read(fs->dir_idx + i, (char *) (DIR + i * entries_per_block)) < 0) {
-            return -1;
-        }
+    for (i = 0; i < cache_nbuckets; i++) {
+        cache_buckets[i] = -1;
     }
-    for(i = 0; i < MAX_FILDES; i++) {
-        fildes_array[i].is_used = 0;
+    lru_head = lru_tail = -1;
+    for (i = 0; i < nblocks; i++) {
+        cache[i].block = -1;
+        cache[i].dirty = 0;
+        cache[i].pins = 0;
+        cache[i].busy = 0;
+        cache[i].hnext = -1;
+        cache[i].data = cache_data + (size_t) i * block_size;
+        lru_push_front(i);
     }
-    fs_mounted = 1;
+    cache_size = nblocks;
     return 0;
 }
 
-int umount_fs(char *disk_name) {
-    if (block_write(0, (char *) fs) < 0) {
-        return -1; // Failed to write the superblock
+static void cache_destroy() {
+    free(cache);
+    free(cache_data);
+    free(cache_buckets);
+    cache = NULL;
+    cache_data = NULL;
+    cache_buckets = NULL;
+    lru_head = lru_tail = -1;
+}
+
+// Needs cache_lock.
+static struct cache_entry *cache_lookup(int block) {
+    int i = cache_buckets[cache_hash(block)];
+    while (i != -1 && cache[i].block != block) {
+        i = cache[i].hnext;
     }
-    int entries_per_block = BLOCK_SIZE / sizeof(int);
-    int i;
-    for (i = 0; i < fs->fat_len; i++) {
-        if (block_write(fs->fat_idx + i, (char *) (FAT + i * entries_per_block)) < 0) {
-            return -1; // Failed to write FAT
+    return i == -1 ? NULL : &cache[i];
+}
+
+static int cache_contains(int block) {
+    pthread_mutex_lock(&cache_lock);
+    int found = cache_lookup(block) != NULL;
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+// Returns the cache slot for block, pinned and made the most recently used
+// one; release it with cache_put. On a miss the least recently used idle slot
+// is recycled; if load is 0 the caller is about to overwrite the whole block,
+// so the old contents are not read from disk.
+static struct cache_entry *cache_get(int block, int load) {
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+        struct cache_entry *e = cache_lookup(block);
+        if (e) {
+            if (e->busy) {
+                pthread_cond_wait(&cache_cond, &cache_lock);
+                continue;
+            }
+            e->pins++;
+            lru_unlink(e - cache);
+            lru_push_front(e - cache);
+            pthread_mutex_unlock(&cache_lock);
+            stats_count(&stats.cache_hits, 1);
+            return e;
         }
-    }
-    entries_per_block = BLOCK_SIZE / sizeof(struct dir_entry);
-    for (i = 0; i < fs->dir_len; i++) {
-        if (block_write(fs->dir_idx + i, (char *) (DIR + i * entries_per_block)) < 0) {
-            return -1; // Failed to write directory
+
+        int victim = lru_tail;
+        while (victim != -1 && (cache[victim].pins > 0 || cache[victim].busy)) {
+            victim = cache[victim].prev;
+        }
+        if (victim == -1) {
+            pthread_cond_wait(&cache_cond, &cache_lock); // every slot is in use
+            continue;
+        }
+        e = &cache[victim];
+        if (e->block != -1 && e->dirty) {
+            // Write the victim back, then look again: things may have moved
+            e->busy = 1;
+            pthread_mutex_unlock(&cache_lock);
+            int failed = block_write(e->block, e->data) < 0;
+            stats_count(&stats.cache_writebacks, 1);
+            pthread_mutex_lock(&cache_lock);
+            e->busy = 0;
+            pthread_cond_broadcast(&cache_cond);
+            if (failed) {
+                pthread_mutex_unlock(&cache_lock);
+                return NULL;
+            }
+            e->dirty = 0;
+            continue;
         }
+        if (e->block != -1) {
+            hash_remove(victim);
+        }
+        e->block = block;
+        e->dirty = 0;
+        e->pins = 1;
+        hash_insert(victim);
+        lru_unlink(victim);
+        lru_push_front(victim);
+        stats_count(&stats.cache_misses, 1);
+        if (load) {
+            e->busy = 1;
+            pthread_mutex_unlock(&cache_lock);
+            int failed = block_read(block, e->data) < 0;
+            pthread_mutex_lock(&cache_lock);
+            e->busy = 0;
+            pthread_cond_broadcast(&cache_cond);
+            if (failed) {
+                hash_remove(victim);
+                e->block = -1;
+                e->pins = 0;
+                pthread_mutex_unlock(&cache_lock);
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return e;
     }
-    if (close_disk() < 0) {
-        return -1; // Failed to close the disk
+}
+
+// Unpins a slot returned by cache_get, marking it dirty if it was modified.
+static void cache_put(struct cache_entry *e, int dirty) {
+    pthread_mutex_lock(&cache_lock);
+    if (dirty) {
+        e->dirty = 1;
     }
-    fs_mounted = 0;
-    return 0;
+    if (--e->pins == 0) {
+        pthread_cond_broadcast(&cache_cond);
+    }
+    pthread_mutex_unlock(&cache_lock);
 }
 
-int fs_open(char *name) {
-    int dir_index = -1;
+// Drops a block from the cache without writing it back.
+static void cache_invalidate(int block) {
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e;
+    while ((e = cache_lookup(block)) && (e->busy || e->pins > 0)) {
+        pthread_cond_wait(&cache_cond, &cache_lock);
+    }
+    if (e) {
+        int i = e - cache;
+        hash_remove(i);
+        e->block = -1;
+        e->dirty = 0;
+        lru_unlink(i);
+        lru_push_back(i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Starts count consecutive blocks from block on loading into the cache, for
+// blocks expected to be read soon. Blocks already cached are skipped and only
+// clean idle slots are recycled, so prefetching never writes anything back.
+// The loads are queued with the disk, which merges adjacent blocks into one
+// read; readers asking for a block meanwhile wait for it in cache_get.
+static void cache_prefetch(int block, int count) {
+    int *slots = malloc(count * sizeof(int));
+    struct disk_request *reqs = calloc(count, sizeof(struct disk_request));
+    if (!slots || !reqs) {
+        free(slots);
+        free(reqs);
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int n = 0;
     int i;
-    for (i = 0; i < MAX_FILES; i++) {
-        if (DIR[i].used && strcmp(DIR[i].name, name) == 0) {
-            dir_index = i;
+    for (i = 0; i < count; i++) {
+        if (cache_lookup(block + i)) {
+            continue;
+        }
+        int victim = lru_tail;
+        while (victim != -1 && (cache[victim].pins > 0 || cache[victim].busy || cache[victim].dirty)) {
+            victim = cache[victim].prev;
+        }
+        if (victim == -1) {
             break;
         }
+        if (cache[victim].block != -1) {
+            hash_remove(victim);
+        }
+        cache[victim].block = block + i;
+        cache[victim].busy = 1;
+        hash_insert(victim);
+        lru_unlink(victim);
+        lru_push_front(victim);
+        slots[n++] = victim;
     }
+    pthread_mutex_unlock(&cache_lock);
 
-    if (dir_index == -1) {
-        return -1; // File not found
+    for (i = 0; i < n; i++) {
+        reqs[i].block = cache[slots[i]].block;
+        reqs[i].count = 1;
+        reqs[i].buf = cache[slots[i]].data;
+    }
+    int submitted = n > 0 && block_submit(reqs, n) == 0;
+    for (i = 0; i < n; i++) {
+        if (!submitted || disk_request_wait(&reqs[i]) < 0) {
+            reqs[i].result = -1;
+        }
     }
 
-    for (i = 0; i < MAX_FILDES; i++) {
-        if (fildes_array[i].is_used == 0) {
-            fildes_array[i].is_used = 1;
-            fildes_array[i].file = dir_index;
-            fildes_array[i].offset = 0;
-            DIR[dir_index].ref_cnt++;
-            return i; // Return the file descriptor
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < n; i++) {
+        struct cache_entry *e = &cache[slots[i]];
+        e->busy = 0;
+        if (reqs[i].result < 0) {
+            hash_remove(slots[i]);
+            e->block = -1;
+            lru_unlink(slots[i]);
+            lru_push_back(slots[i]);
         }
     }
-    return -1; // No free file descriptors
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    free(reqs);
+    free(slots);
 }
 
-int fs_close(int fildes) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
-    }
-    int file_head = fildes_array[fildes].file;
-    fildes_array[fildes].is_used = 0;
-    fildes_array[fildes].file = 0;
-    fildes_array[fildes].offset = 0;
+static int compare_slots_by_block(const void *a, const void *b) {
+    return cache[*(const int *) a].block - cache[*(const int *) b].block;
+}
 
+// Writes every dirty block back to disk in ascending block order. Blocks that
+// are pinned right now are being changed and are left for the next flush.
+static int cache_flush() {
+    pthread_mutex_lock(&cache_lock);
+    if (!cache) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    int *dirty = malloc(cache_size * sizeof(int));
+    struct disk_request *reqs = calloc(cache_size, sizeof(struct disk_request));
+    if (!dirty || !reqs) {
+        pthread_mutex_unlock(&cache_lock);
+        free(dirty);
+        free(reqs);
+        return -1;
+    }
+    int count = 0;
     int i;
-    for (i = 0; i < MAX_FILES; i++) {
-        if (DIR[i].used && DIR[i].head == file_head) {
-            DIR[i].ref_cnt--;
-            break;
+    for (i = 0; i < cache_size; i++) {
+        if (cache[i].block != -1 && cache[i].dirty && !cache[i].busy && cache[i].pins == 0) {
+            cache[i].busy = 1;
+            dirty[count++] = i;
         }
     }
-    return 0; // Success
-}
+    qsort(dirty, count, sizeof(int), compare_slots_by_block);
+    pthread_mutex_unlock(&cache_lock);
 
-int fs_create(char *name) {
-    if (strlen(name) > MAX_F_NAME || strlen(name) == 0) {
-        return -1; // File name too long
+    // Each block is queued as a request of its own; the disk merges runs of
+    // adjacent blocks into single writes and works on separate runs at once
+    for (i = 0; i < count; i++) {
+        reqs[i].write = 1;
+        reqs[i].block = cache[dirty[i]].block;
+        reqs[i].count = 1;
+        reqs[i].buf = cache[dirty[i]].data;
     }
-    int i;
-    for(i = 0; i < MAX_FILES; i++) {
-        if (strcmp(DIR[i].name, name) == 0) {
-            return -1; // File already exists
+    int submitted = count == 0 || block_submit(reqs, count) == 0;
+    int result = submitted ? 0 : -1;
+    for (i = 0; submitted && i < count; i++) {
+        if (disk_request_wait(&reqs[i]) < 0) {
+            result = -1;
         }
     }
 
-    int dir_index = -1;
-    for(i = 0; i < MAX_FILES; i++) {
-        if (DIR[i].used == 0) {
-            dir_index = i;
-            break;
+    // Blocks that failed to write stay dirty for the next flush
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; i++) {
+        if (submitted && reqs[i].result == 0) {
+            cache[dirty[i]].dirty = 0;
         }
+        cache[dirty[i]].busy = 0;
     }
-    if (dir_index == -1) {
-        return -1; // No free directory slots
-    }
-    
-    DIR[dir_index].used = 1;
-    strcpy(DIR[dir_index].name, name);
-    DIR[dir_index].size = 0;
-    DIR[dir_index].head = -1;
-    DIR[dir_index].ref_cnt = 0;
-    
-    return 0; // Success
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    free(reqs);
+    free(dirty);
+    return result;
 }
 
-int fs_delete(char *name) {
-    int i;
-    int dir_index = -1;
-    int block_index = -1;
-    for(i = 0; i < MAX_FILES; i++) {
-        if (strcmp(DIR[i].name, name) == 0) {
-            if (DIR[i].ref_cnt > 0) {
-                return -1; // File is open
-            }
-            dir_index = i;
-            block_index = DIR[i].head;
-            break;
+// The FAT and directory as of the last commit, which is what checkpoints write
+// to the home blocks: changes not committed yet must never reach them, or a
+// crash during the checkpoint would leave them there with no journal record
+// to finish or undo them. NULL while not mounted.
+static int *fat_committed = NULL;
+static struct dir_entry *dir_committed = NULL;
+
+// Home blocks of the FAT and directory whose committed copy has changed since
+// it was last written, one flag per block. NULL while not mounted.
+static unsigned char *fat_block_dirty = NULL;
+static unsigned char *dir_block_dirty = NULL;
+
+#define FAT_PER_BLOCK (block_size / sizeof(int))
+#define DIR_PER_BLOCK (block_size / sizeof(struct dir_entry))
+
+// Writes the blocks of one metadata table that are flagged dirty (all of them
+// if dirty is NULL), one write per run of adjacent blocks.
+static int write_table(int first, int len, char *table, unsigned char *dirty) {
+    int i = 0;
+    while (i < len) {
+        if (dirty && !dirty[i]) {
+            i++;
+            continue;
         }
+        int run = 1;
+        while (i + run < len && (!dirty || dirty[i + run])) {
+            run++;
+        }
+        if (block_write_range(first + i, run, table + (size_t) i * block_size) < 0) {
+            return -1;
+        }
+        if (dirty) {
+            memset(dirty + i, 0, run);
+        }
+        i += run;
     }
-    if (dir_index == -1) {
-        return -1; // File not found
-    }
+    return 0;
+}
 
-    char block_buf[BLOCK_SIZE];
-    memset(block_buf, '\0', BLOCK_SIZE);
-    while (block_index != -1) {
-        int next = FAT[block_index];
-        if (block_write(block_index, block_buf) < 0) {
-            return -1; // Failed to write block
-        }
-        FAT[block_index] = 0; // Mark block as free
-        block_index = next;
+// Writes the changed blocks of the committed FAT and directory to their home
+// locations; with all set (make_fs), the superblock and every block of FAT
+// and DIR are written.
+static int write_metadata(int all) {
+    if (all && block_write(0, (char *) fs) < 0) {
+        return -1;
     }
-    DIR[dir_index].used = 0;
-    memset(DIR[dir_index].name, '\0', MAX_F_NAME + 1);
-    DIR[dir_index].size = 0;
-    DIR[dir_index].head = -1;
-    DIR[dir_index].ref_cnt = 0;
-    if (block_write(fs->dir_idx, (char *) DIR) < 0) {
-        return -1; // Failed to write directory
+    char *fat = (char *) (all ? FAT : fat_committed);
+    char *dir = (char *) (all ? DIR : dir_committed);
+    if (write_table(fs->fat_idx, fs->fat_len, fat, all ? NULL : fat_block_dirty) < 0) {
+        return -1;
     }
-    return 0; // Success
+    if (write_table(fs->dir_idx, fs->dir_len, dir, all ? NULL : dir_block_dirty) < 0) {
+        return -1;
+    }
+    if (all && fat_block_dirty) {
+        memset(fat_block_dirty, 0, fs->fat_len);
+        memset(dir_block_dirty, 0, fs->dir_len);
+    }
+    return 0;
 }
 
-int fs_read(int fildes, void *buf, size_t nbyte) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
+// Metadata journal. FAT and directory changes are not written to their home
+// blocks as they happen; the entries touched since the last commit are
+// remembered and, at commit time, written as one group of compact records to
+// the journal region with a single sequential write. Groups are replayed at
+// mount. The home blocks are only rewritten at checkpoints, with what has been
+// committed: once the journal is past JOURNAL_HIGH_WATER after a commit, when
+// a group does not fit in what is left of it, and at unmount.
+struct journal_header {
+    int magic;
+    int seq; // must equal the previous group's seq + 1
+    int nblocks; // blocks taken by the group, this header included
+    int nbytes; // bytes of records following the header
+    unsigned int checksum; // over the record bytes
+};
+
+#define JREC_FAT 1 // FAT[index + k] = value + k * step for k < count
+#define JREC_DIR 2 // DIR[index] = entry
+
+struct journal_fat_record {
+    int type;
+    int index;
+    int count;
+    int value;
+    int step;
+};
+
+struct journal_dir_record {
+    int type;
+    int index;
+    struct dir_entry entry;
+};
+
+static int journal_head = 0; // next free block in the journal, relative to journal_idx
+static int journal_next_seq = 0; // seq of the next group to be written
+static int *dirty_fat = NULL; // FAT entries changed since the last commit, room for all
+static int dirty_fat_count = 0;
+static unsigned char *fat_logged = NULL; // per block: already in dirty_fat
+static int *dirty_dir = NULL; // directory slots changed since the last commit
+static int dirty_dir_count = 0;
+static unsigned char *dir_logged = NULL;
+// Blocks freed since the last commit and not allocated again. Once the commit
+// makes their release durable they are discarded, so the disk image stops
+// using space for them.
+static uint64_t *freed_map = NULL;
+static int freed_count = 0; // blocks set in freed_map since it was last emptied, at least
+
+// Needs meta_lock, like everything else that changes the FAT or DIR.
+static void fat_set(int block, int value) {
+    FAT[block] = value;
+    if (!fat_logged || fat_logged[block]) {
+        return;
     }
+    fat_logged[block] = 1;
+    dirty_fat[dirty_fat_count++] = block;
+}
 
-    int dir_index = fildes_array[fildes].file;
-    int offset = fildes_array[fildes].offset;
-    int file_size = DIR[dir_index].size;
-    int num_bytes_read = 0;
+static void dir_changed(int dir_index) {
+    if (!dir_logged || dir_logged[dir_index]) {
+        return;
+    }
+    dir_logged[dir_index] = 1;
+    dirty_dir[dirty_dir_count++] = dir_index;
+}
 
-    // Check if we are at the end of the file
-    if (offset >= file_size) {
-        return 0; // EOF
+static unsigned int journal_checksum(const char *data, int len) {
+    unsigned int h = 2166136261u; // FNV-1a
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) data[i]) * 16777619u;
     }
+    return h;
+}
 
-    int current_block = DIR[dir_index].head;
-    int blocks_to_skip = offset / BLOCK_SIZE;
+static void journal_forget_changes() {
     int i;
-    // Skip to the correct block
-    for (i = 0; i < blocks_to_skip; i++) {
-        if(current_block == -1 || current_block == 0) {
-            return 0;
-        }
-        current_block = FAT[current_block];
+    for (i = 0; i < dirty_fat_count; i++) {
+        fat_logged[dirty_fat[i]] = 0;
     }
+    for (i = 0; i < dirty_dir_count; i++) {
+        dir_logged[dirty_dir[i]] = 0;
+    }
+    dirty_fat_count = 0;
+    dirty_dir_count = 0;
+}
 
-    int block_offset = offset % BLOCK_SIZE;
-    char read_buf[BLOCK_SIZE];
+// Copies dirty_fat[fat_from..fat_to) and dirty_dir[dir_from..dir_to), just
+// committed, into the committed FAT and directory.
+static void journal_settle(int fat_from, int fat_to, int dir_from, int dir_to) {
+    int i;
+    for (i = fat_from; i < fat_to; i++) {
+        fat_committed[dirty_fat[i]] = FAT[dirty_fat[i]];
+        fat_block_dirty[dirty_fat[i] / FAT_PER_BLOCK] = 1;
+    }
+    for (i = dir_from; i < dir_to; i++) {
+        dir_committed[dirty_dir[i]] = DIR[dirty_dir[i]];
+        dir_block_dirty[dirty_dir[i] / DIR_PER_BLOCK] = 1;
+    }
+}
 
-    // Read the file
-    while(num_bytes_read < nbyte && current_block != -1 && current_block != 0) {
-        if (block_read(current_block, read_buf) < 0) {
-            return -1;
-        }
-        int bytes_left = file_size - (offset + num_bytes_read);
-        if (bytes_left <= 0) {
-            break;
+// Discards each run of blocks in freed_map with one call. Discarding is only
+// a hint to the disk, so failures are ignored. Only called once the commit that
+// freed the blocks is on stable storage: a crash before that brings the old
+// FAT back, still pointing at them.
+static void discard_freed() {
+    if (!freed_map || freed_count == 0) {
+        return;
+    }
+    int words = (disk_blocks + 63) / 64;
+    int start = -1;
+    int w;
+    for (w = 0; w <= words; w++) {
+        uint64_t bits = w < words ? freed_map[w] : 0;
+        if (start == -1 && bits == 0) {
+            continue;
         }
-
-        int bytes_to_read = BLOCK_SIZE - block_offset;
-        if (bytes_to_read > bytes_left) {
-            bytes_to_read = bytes_left;
+        int bit;
+        for (bit = 0; bit < 64; bit++) {
+            int block = w * 64 + bit;
+            int freed = (bits >> bit) & 1;
+            if (freed && start == -1) {
+                start = block;
+            } else if (!freed && start != -1) {
+                block_discard(start, block - start);
+                start = -1;
+            }
+            if (start == -1 && (bits >> bit) == 0) {
+                break; // nothing freed in the rest of this word
+            }
         }
-        if (bytes_to_read > nbyte - num_bytes_read) {
-            bytes_to_read = nbyte - num_bytes_read;
+        if (w < words) {
+            freed_map[w] = 0;
         }
-
-        memcpy((char *)buf + num_bytes_read, read_buf + block_offset, bytes_to_read);
-        num_bytes_read += bytes_to_read;
-        block_offset = 0;
-        current_block = FAT[current_block];
     }
-    fildes_array[fildes].offset += num_bytes_read;
-    return num_bytes_read;
+    freed_count = 0;
 }
 
-int get_next_block() {
-    int i;
-    for (i = fs->data_idx; i < DISK_BLOCKS; i++) {
-        if (FAT[i] == 0) {
-            FAT[i] = -1;
-            return i;
-        }
+// Writes the committed FAT and directory to the home blocks and empties the
+// journal. Bumping journal_seq in the superblock retires every group written
+// so far, so the home blocks have to be on the disk before it is. Without a
+// journal every change counts as committed. Needs meta_lock.
+static int checkpoint() {
+    if (fs->journal_len == 0) {
+        journal_settle(0, dirty_fat_count, 0, dirty_dir_count);
+        journal_forget_changes();
     }
-    return -1;
-}
-
-int fs_write(int fildes, void *buf, size_t nbyte) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
+    // Data and journal groups first, so home blocks never get ahead of them
+    if (disk_flush() < 0 || write_metadata(0) < 0) {
+        return -1;
     }
-
-    // Check if disk is full
-    int free_blocks = 0;
-    int i;
-    for(i = fs->data_idx; i < DISK_BLOCKS; i++) {
-        if (FAT[i] == 0) {
-            free_blocks++;
+    if (fs->journal_len > 0) {
+        if (disk_flush() < 0) {
+            return -1;
+        }
+        fs->journal_seq = journal_next_seq;
+        if (block_write(0, (char *) fs) < 0) {
+            return -1;
         }
     }
-    if (free_blocks == 0) {
-        return 0; // Disk is full
+    if (disk_flush() < 0) {
+        return -1;
     }
-    int free_bytes = free_blocks * BLOCK_SIZE;
-    if (nbyte > free_bytes) {
-        nbyte = free_bytes;
+    journal_head = 0;
+    if (dirty_fat_count == 0 && dirty_dir_count == 0) {
+        discard_freed(); // every release is committed and on the disk
     }
+    return 0;
+}
 
-    int dir_index = fildes_array[fildes].file;
-    int offset = fildes_array[fildes].offset;
-    int num_bytes_written = 0;
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return x < y ? -1 : x > y;
+}
 
-    // Check if we are at the end of the file
-    if (DIR[dir_index].size + nbyte > BLOCK_SIZE * 4096) {
-        nbyte = BLOCK_SIZE * 4096 - DIR[dir_index].size;
-        if (nbyte <= 0) {
-            return 0;
+// Encodes dirty_fat from *fat_i and dirty_dir from *dir_i as journal records
+// at p, as many as fit in room bytes, and moves the two positions past them.
+// Runs of FAT entries that are equal or count up by one (freed runs and
+// contiguous chains) become a single record. With p NULL it only counts.
+// Returns the bytes used.
+static size_t journal_records(char *p, size_t room, int *fat_i, int *dir_i) {
+    size_t used = 0;
+    int i = *fat_i;
+    while (i < dirty_fat_count && used + sizeof(struct journal_fat_record) <= room) {
+        struct journal_fat_record rec;
+        rec.type = JREC_FAT;
+        rec.index = dirty_fat[i];
+        rec.value = FAT[rec.index];
+        rec.count = 1;
+        rec.step = 0;
+        if (i + 1 < dirty_fat_count && dirty_fat[i + 1] == rec.index + 1) {
+            int step = FAT[rec.index + 1] - rec.value;
+            if (step == 0 || step == 1) {
+                rec.step = step;
+                while (i + rec.count < dirty_fat_count &&
+                       dirty_fat[i + rec.count] == rec.index + rec.count &&
+                       FAT[rec.index + rec.count] == rec.value + rec.count * step) {
+                    rec.count++;
+                }
+            }
+        }
+        if (p) {
+            memcpy(p + used, &rec, sizeof(rec));
         }
+        used += sizeof(rec);
+        i += rec.count;
     }
-
-    int blocks_to_skip = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
-    int current_block = DIR[dir_index].head;
-
-    if (current_block == -1) {
-        int new_block = get_next_block();
-        if (new_block == -1) {
-            return 0;
+    *fat_i = i;
+    for (i = *dir_i; i < dirty_dir_count && used + sizeof(struct journal_dir_record) <= room; i++) {
+        struct journal_dir_record rec;
+        rec.type = JREC_DIR;
+        rec.index = dirty_dir[i];
+        rec.entry = DIR[rec.index];
+        if (p) {
+            memcpy(p + used, &rec, sizeof(rec));
         }
-        DIR[dir_index].head = new_block;
-        current_block = new_block;
+        used += sizeof(rec);
     }
+    *dir_i = i;
+    return used;
+}
 
-    // Skip to the correct block
-    for(i = 0; i < blocks_to_skip; i++) {
-        if (FAT[current_block] == -1) {
-            int new_block = get_next_block();
-            if (new_block == -1) {
-                return 0;
+// Writes the changes made since the last commit to the journal as one group.
+// If the group does not fit in what is left of the journal, a checkpoint of
+// the committed state empties it first; a group bigger than the whole journal
+// is split into several, each committed on its own. Needs meta_lock.
+static int journal_commit() {
+    if (dirty_fat_count == 0 && dirty_dir_count == 0) {
+        return 0;
+    }
+    if (fs->journal_len == 0) {
+        return checkpoint();
+    }
+    if (dirty_fat_count > 0) {
+        qsort(dirty_fat, dirty_fat_count, sizeof(int), compare_ints);
+    }
+    int fat_done = 0;
+    int dir_done = 0;
+    while (fat_done < dirty_fat_count || dir_done < dirty_dir_count) {
+        int room = fs->journal_len - journal_head;
+        int fat_i = fat_done;
+        int dir_i = dir_done;
+        size_t need = sizeof(struct journal_header) + journal_records(NULL, SIZE_MAX, &fat_i, &dir_i);
+        int nblocks = (need + block_size - 1) / block_size;
+        if (nblocks > room && journal_head > 0) {
+            if (checkpoint() < 0) {
+                return -1;
             }
-            FAT[current_block] = new_block;
-            current_block = new_block;
+            continue;
         }
-        else {
-            current_block = FAT[current_block];
+        if (nblocks > room) {
+            nblocks = room;
         }
-    }
+        char *group = disk_buffer((size_t) nblocks * block_size);
+        if (!group) {
+            return -1;
+        }
+        fat_i = fat_done;
+        dir_i = dir_done;
+        size_t nbytes = journal_records(group + sizeof(struct journal_header),
+                                        (size_t) nblocks * block_size - sizeof(struct journal_header),
+                                        &fat_i, &dir_i);
+        struct journal_header *h = (struct journal_header *) group;
+        h->magic = JOURNAL_MAGIC;
+        h->seq = journal_next_seq;
+        h->nbytes = nbytes;
+        h->nblocks = (sizeof(struct journal_header) + nbytes + block_size - 1) / block_size;
+        h->checksum = journal_checksum(group + sizeof(struct journal_header), h->nbytes);
+        nblocks = h->nblocks;
 
-    char write_buf[BLOCK_SIZE];
-    // Write the file
-    while(num_bytes_written < nbyte) {
-        if(block_read(current_block, write_buf) < 0) {
-            return num_bytes_written;
+        // The blocks the group links to have to be on the disk before it is,
+        // and the group before anything that relies on it having been
+        // committed. New blocks are written before they are linked, never just
+        // left in the cache, so the cache does not need flushing here.
+        if (disk_flush() < 0 || block_write_range(fs->journal_idx + journal_head, nblocks, group) < 0 ||
+            disk_flush() < 0) {
+            free(group);
+            return -1; // the changes stay queued; those already committed are logged again
         }
+        free(group);
+        journal_head += nblocks;
+        journal_next_seq++;
+        journal_settle(fat_done, fat_i, dir_done, dir_i);
+        fat_done = fat_i;
+        dir_done = dir_i;
+    }
+    journal_forget_changes();
+    // Home and committed state are the same now, the cheapest time to
+    // checkpoint; it leaves room for the next group
+    if (journal_head > fs->journal_len * JOURNAL_HIGH_WATER / 100) {
+        return checkpoint();
+    }
+    discard_freed(); // the groups freeing them are durable
+    return 0;
+}
 
-        int bytes_to_write = BLOCK_SIZE - block_offset;
-        if (bytes_to_write > nbyte - num_bytes_written) {
-            bytes_to_write = nbyte - num_bytes_written;
+// Replays the committed groups found in the journal, in order, stopping at the
+// first block that does not hold the next valid group. Returns the number of
+// groups applied.
+static int journal_replay() {
+    int applied = 0;
+    int at = 0;
+    char *block = disk_buffer(block_size);
+    if (!block) {
+        return -1;
+    }
+    journal_next_seq = fs->journal_seq;
+    while (at < fs->journal_len) {
+        if (block_read(fs->journal_idx + at, block) < 0) {
+            break;
         }
-        memcpy(write_buf + block_offset, (char *) buf + num_bytes_written, bytes_to_write);
-        
-        if (block_write(current_block, write_buf) < 0) {
-            return num_bytes_written;
+        struct journal_header h;
+        memcpy(&h, block, sizeof(h));
+        if (h.magic != JOURNAL_MAGIC || h.seq != journal_next_seq || h.nblocks <= 0 ||
+            at + h.nblocks > fs->journal_len || h.nbytes < 0 ||
+            h.nbytes > h.nblocks * block_size - (int) sizeof(h)) {
+            break;
         }
-        num_bytes_written += bytes_to_write;
-        fildes_array[fildes].offset += bytes_to_write;
-        if (fildes_array[fildes].offset > DIR[dir_index].size) {
-            DIR[dir_index].size = fildes_array[fildes].offset;
+        char *group = disk_buffer((size_t) h.nblocks * block_size);
+        if (!group || block_read_range(fs->journal_idx + at, h.nblocks, group) < 0) {
+            free(group);
+            break;
         }
-        block_offset = 0;
-
-        if (FAT[current_block] == -1) {
-            if (num_bytes_written < nbyte) {
-                int new_block = get_next_block();
-                if (new_block == -1) {
-                    return num_bytes_written;
+        char *p = group + sizeof(h);
+        char *end = p + h.nbytes;
+        if (journal_checksum(p, h.nbytes) != h.checksum) {
+            free(group); // torn write: the group never committed
+            break;
+        }
+        while (p < end) {
+            int type;
+            memcpy(&type, p, sizeof(int));
+            if (type == JREC_FAT) {
+                struct journal_fat_record rec;
+                memcpy(&rec, p, sizeof(rec));
+                int k;
+                for (k = 0; k < rec.count; k++) {
+                    if (rec.index + k >= 0 && rec.index + k < disk_blocks) {
+                        FAT[rec.index + k] = rec.value + k * rec.step;
+                    }
                 }
-                FAT[current_block] = new_block;
-                current_block = new_block;
+                p += sizeof(rec);
+            } else if (type == JREC_DIR) {
+                struct journal_dir_record rec;
+                memcpy(&rec, p, sizeof(rec));
+                if (rec.index >= 0 && rec.index < dir_slots) {
+                    DIR[rec.index] = rec.entry;
+                }
+                p += sizeof(rec);
+            } else {
+                break;
             }
         }
-        else {
-            current_block = FAT[current_block];
-        }
-        memset(write_buf, '\0', BLOCK_SIZE);
+        free(group);
+        at += h.nblocks;
+        journal_next_seq++;
+        applied++;
     }
-    return num_bytes_written;
+    free(block);
+    return applied;
 }
 
-int fs_get_filesize(int fildes) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
+// Commits the current group once enough changes have piled up in it.
+static void journal_maybe_commit() {
+    pthread_mutex_lock(&meta_lock);
+    if (dirty_fat_count + dirty_dir_count >= JOURNAL_GROUP_RECORDS) {
+        journal_commit(); // on failure the changes stay queued for the next commit
     }
-    return DIR[fildes_array[fildes].file].size;
+    pthread_mutex_unlock(&meta_lock);
 }
 
-int fs_listfiles(char ***files) {
-    char **file_list = malloc(MAX_FILES * sizeof(char *));
-    int count = 0;
-    int i;
-    for(i = 0; i < MAX_FILES; i++) {
-        if (DIR[i].used) {
+// Free-space bitmap, rebuilt from the FAT at mount time so the FAT never has
+// to be scanned on the allocation path. A set bit means the block is free.
+// Guarded by meta_lock.
+static uint64_t *free_map = NULL;
+static int free_map_words = 0;
+static int free_blocks = 0; // number of set bits in free_map
+static int alloc_cursor = 0; // word where the next search starts (next-fit)
+
+static int free_map_build() {
+    free_map_words = (disk_blocks + 63) / 64;
+    free_map = calloc(free_map_words, sizeof(uint64_t));
+    if (!free_map) {
+        return -1;
+    }
+    free_blocks = 0;
+    int i;
+    for (i = fs->data_idx; i < disk_blocks; i++) {
+        if (FAT[i] == 0) {
+            free_map[i / 64] |= (uint64_t) 1 << (i % 64);
+            free_blocks++;
+        }
+    }
+    alloc_cursor = fs->data_idx / 64;
+    return 0;
+}
+
+static void free_map_destroy() {
+    free(free_map);
+    free_map = NULL;
+    free_map_words = 0;
+    free_blocks = 0;
+}
+
+// Takes a free block and marks it as the end of a chain in the FAT.
+static int alloc_block() {
+    if (free_blocks == 0) {
+        return -1;
+    }
+    int n;
+    for (n = 0; n < free_map_words; n++) {
+        int w = alloc_cursor;
+        if (free_map[w] != 0) {
+            int block = w * 64 + __builtin_ctzll(free_map[w]);
+            free_map[w] &= free_map[w] - 1;
+            free_blocks--;
+            if (freed_map) {
+                freed_map[w] &= ~((uint64_t) 1 << (block % 64));
+            }
+            fat_set(block, -1);
+            return block;
+        }
+        alloc_cursor = (alloc_cursor + 1) % free_map_words;
+    }
+    return -1;
+}
+
+static int block_is_free(int block) {
+    return (free_map[block / 64] >> (block % 64)) & 1;
+}
+
+// Finds the first run of at least want free blocks at or after the next-fit
+// cursor, wrapping around once. If no run is long enough, returns the longest
+// one seen. Runs never wrap past the end of the disk.
+static int find_free_run(int want, int *len) {
+    int best = -1;
+    int best_len = 0;
+    int run_start = -1;
+    int run_len = 0;
+    int n;
+    for (n = 0; n < free_map_words; n++) {
+        int w = (alloc_cursor + n) % free_map_words;
+        if (w == 0 || free_map[w] != ~(uint64_t) 0) {
+            // A run can only continue into a full word or the next bit
+            int bit;
+            for (bit = 0; bit < 64; bit++) {
+                if (bit == 0 && w == 0) {
+                    if (run_len > best_len) {
+                        best = run_start; // the run that ended the disk
+                        best_len = run_len;
+                    }
+                    run_len = 0;
+                }
+                if ((free_map[w] >> bit) & 1) {
+                    if (run_len == 0) {
+                        run_start = w * 64 + bit;
+                    }
+                    if (++run_len >= want) {
+                        *len = run_len;
+                        return run_start;
+                    }
+                } else {
+                    if (run_len > best_len) {
+                        best = run_start;
+                        best_len = run_len;
+                    }
+                    run_len = 0;
+                }
+                if (free_map[w] == 0) {
+                    break; // nothing free in this word
+                }
+            }
+        } else {
+            if (run_len == 0) {
+                run_start = w * 64;
+            }
+            run_len += 64;
+            if (run_len >= want) {
+                *len = run_len;
+                return run_start;
+            }
+        }
+    }
+    if (run_len > best_len) {
+        best = run_start;
+        best_len = run_len;
+    }
+    *len = best_len;
+    return best;
+}
+
+// Allocates up to want contiguous blocks. A run starting at goal (the block
+// after the end of the file) is taken if it is long enough; otherwise the
+// first long enough run anywhere, and failing that the longest free run.
+// Returns the first block and its length in got. The blocks are only taken
+// out of the free map; the caller chains them in the FAT once their data is
+// on disk, so a commit in between cannot log blocks that nothing points to.
+static int alloc_extent(int goal, int want, int *got) {
+    int start = -1;
+    int len = 0;
+    if (goal >= fs->data_idx && goal < disk_blocks && block_is_free(goal)) {
+        start = goal;
+        while (len < want && goal + len < disk_blocks && block_is_free(goal + len)) {
+            len++;
+        }
+    }
+    if (len < want) {
+        int run_len;
+        int run = find_free_run(want, &run_len);
+        if (run_len > len) {
+            start = run;
+            len = run_len;
+        }
+    }
+    if (start == -1 || len == 0) {
+        return -1;
+    }
+    if (len > want) {
+        len = want;
+    }
+    int i;
+    for (i = 0; i < len; i++) {
+        int block = start + i;
+        free_map[block / 64] &= ~((uint64_t) 1 << (block % 64));
+        if (freed_map) {
+            freed_map[block / 64] &= ~((uint64_t) 1 << (block % 64)); // in use again, keep it
+        }
+    }
+    free_blocks -= len;
+    alloc_cursor = (start + len) / 64 % free_map_words;
+    *got = len;
+    return start;
+}
+
+// Returns a block to the free pool, dropping any cached copy of it. Its
+// contents are left as they are; the block is discarded after the next commit.
+static void release_block(int block) {
+    cache_invalidate(block);
+    fat_set(block, 0);
+    free_map[block / 64] |= (uint64_t) 1 << (block % 64);
+    free_blocks++;
+    if (freed_map) {
+        freed_map[block / 64] |= (uint64_t) 1 << (block % 64);
+        freed_count++;
+    }
+}
+
+// Reference counts for blocks shared between clones. block_refs[b] counts the
+// directory heads and FAT entries pointing at b, so a file shares a block
+// with a clone when that block, or any block before it in the chain, has more
+// than one. Rebuilt from the FAT at mount time and guarded by meta_lock.
+static int *block_refs = NULL;
+static int shared_blocks = 0; // blocks with more than one reference
+static int tail_block = -1; // tail block new tails go into, -1 for none yet
+static int tail_used = 0; // bytes of it taken
+
+static void block_ref(int block) {
+    if (++block_refs[block] == 2) {
+        shared_blocks++;
+    }
+}
+
+// Drops a reference to block. A block left with none is freed, which drops
+// its own reference to the next block of the chain, and so on.
+static void block_unref(int block) {
+    while (block != -1 && block != 0) {
+        if (--block_refs[block] == 1) {
+            shared_blocks--;
+        }
+        if (block_refs[block] > 0) {
+            break; // still part of another file
+        }
+        int next = FAT[block];
+        release_block(block);
+        block = next;
+    }
+}
+
+static int block_refs_build() {
+    block_refs = calloc(disk_blocks, sizeof(int));
+    if (!block_refs) {
+        return -1;
+    }
+    shared_blocks = 0;
+    int i;
+    for (i = 0; i < dir_slots; i++) {
+        if (DIR[i].used && DIR[i].head > 0 && DIR[i].head < disk_blocks) {
+            block_ref(DIR[i].head);
+        }
+    }
+    for (i = fs->data_idx; i < disk_blocks; i++) {
+        if (FAT[i] > 0 && FAT[i] < disk_blocks) {
+            block_ref(FAT[i]);
+        }
+    }
+    for (i = 0; i < dir_slots; i++) {
+        if (DIR[i].used && DIR[i].flags & DIR_TAIL) {
+            block_refs[DIR[i].tail.block]++;
+        }
+    }
+    tail_block = -1;
+    return 0;
+}
+
+// Tail packing. When a file's pending blocks are flushed on close or sync, a
+// last block that is at most half full is packed into a tail block together
+// with the ends of other files, and a file of at most DIR_INLINE_BYTES goes
+// into its directory entry instead.
+// Tails are appended to the current tail block and their space is not reused;
+// a tail block is freed once none of the tails in it is left. Its block_refs
+// count the tails in it. Needs meta_lock.
+static int tail_alloc(int len, int *offset) {
+    if (tail_block == -1 || tail_used + len > block_size) {
+        int block = alloc_block();
+        if (block == -1) {
+            return -1;
+        }
+        block_refs[block] = 0;
+        tail_block = block;
+        tail_used = 0;
+    }
+    *offset = tail_used;
+    tail_used += len;
+    block_refs[tail_block]++;
+    return tail_block;
+}
+
+static void tail_unref(int block) {
+    if (--block_refs[block] == 0) {
+        if (block == tail_block) {
+            tail_block = -1;
+        }
+        release_block(block);
+    }
+}
+
+// Forgets where a file's packed end is. Needs meta_lock.
+static void file_drop_packed(int dir_index) {
+    if (DIR[dir_index].flags & DIR_TAIL) {
+        tail_unref(DIR[dir_index].tail.block);
+    }
+    DIR[dir_index].flags &= ~DIR_PACKED;
+    memset(DIR[dir_index].data, 0, DIR_INLINE_BYTES);
+    dir_changed(dir_index);
+}
+
+// In-memory state for each directory slot while the file system is mounted.
+// The block index maps logical block numbers straight to disk blocks; it is
+// built from the FAT chain the first time a file is accessed out of order.
+struct file_info {
+    int *index; // index[i] is the i-th block of the chain, NULL until built
+    int index_len;
+    int index_cap;
+    int gen; // bumped whenever blocks are unlinked from the chain
+    // Leading logical blocks known not to be shared with a clone. Only
+    // cloning can share a chain, so this stays true until the next clone.
+    int private_len;
+    // Delayed allocation: blocks written past the end of the chain are kept
+    // here and only get disk space when they are flushed, so they can be
+    // given one contiguous extent.
+    char *pending; // pending_count blocks of data, pending_cap allocated
+    int pending_count;
+    int pending_cap;
+    int pending_start; // logical block number of the first pending block
+    int pending_tail; // last disk block of the chain, -1 if it has none
+    int pending_listed; // in pending_files, under meta_lock
+    int ref_cnt; // how many open file descriptors are there? ref_cnt > 0 -> cannot delete file
+    int children; // entries in this slot if it is a directory, under dir_lock
+    struct zfile *z; // compression state of a compressed file, NULL until used
+    pthread_rwlock_t lock; // see the lock order at the top of the file
+    pthread_mutex_t index_lock; // lets readers sharing lock build the index and use z
+};
+
+static struct file_info *finfo = NULL;
+static int reserved_blocks = 0; // free blocks promised to pending data
+static int *pending_files = NULL; // files that may have pending data, under meta_lock
+static int pending_files_count = 0;
+
+#define MAX_PENDING_BYTES (1024 * 1024) // pending data per file before it is flushed
+static int max_pending_blocks = 0; // the same in blocks, at least one
+
+#define INDEX_WALK_LIMIT 8 // FAT steps a lookup may take before the index is built instead
+
+static void file_forget_blocks(int dir_index) {
+    free(finfo[dir_index].index);
+    finfo[dir_index].index = NULL;
+    finfo[dir_index].index_len = 0;
+    finfo[dir_index].index_cap = 0;
+    finfo[dir_index].gen++;
+}
+
+static int index_append(struct file_info *fi, int block) {
+    if (fi->index_len == fi->index_cap) {
+        int cap = fi->index_cap ? fi->index_cap * 2 : 64;
+        int *index = realloc(fi->index, cap * sizeof(int));
+        if (!index) {
+            return -1;
+        }
+        fi->index = index;
+        fi->index_cap = cap;
+    }
+    fi->index[fi->index_len++] = block;
+    return 0;
+}
+
+static int file_build_index(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    int block = DIR[dir_index].head;
+    fi->index_len = 0;
+    while (block != -1 && block != 0) {
+        if (index_append(fi, block) < 0) {
+            file_forget_blocks(dir_index);
+            return -1;
+        }
+        block = FAT[block];
+    }
+    if (!fi->index) {
+        fi->index = malloc(64 * sizeof(int)); // empty files still count as indexed
+        fi->index_cap = fi->index ? 64 : 0;
+    }
+    return fi->index ? 0 : -1;
+}
+
+// Returns the disk block holding logical block lblock of the file open on
+// fildes, or -1 if the chain is not that long, and moves the descriptor's
+// cursor there. Short forward moves walk the FAT from the cursor; anything
+// else goes through the block index.
+static int fd_block(int fildes, int lblock) {
+    struct file_descriptor *fd = &fildes_array[fildes];
+    struct file_info *fi = &finfo[fd->file];
+    int block;
+    int at;
+
+    pthread_mutex_lock(&fi->index_lock);
+    if (fd->cur_block != -1 && fd->cur_gen == fi->gen &&
+        lblock >= fd->cur_index && lblock - fd->cur_index <= INDEX_WALK_LIMIT) {
+        block = fd->cur_block;
+        at = fd->cur_index;
+    } else if (!fi->index && lblock <= INDEX_WALK_LIMIT) {
+        block = DIR[fd->file].head;
+        at = 0;
+    } else {
+        if ((!fi->index && file_build_index(fd->file) < 0) || lblock >= fi->index_len) {
+            pthread_mutex_unlock(&fi->index_lock);
+            return -1;
+        }
+        block = fi->index[lblock];
+        at = lblock;
+    }
+    pthread_mutex_unlock(&fi->index_lock);
+    while (at < lblock && block != -1 && block != 0) {
+        block = FAT[block];
+        at++;
+    }
+    if (block == -1 || block == 0) {
+        return -1;
+    }
+    fd->cur_block = block;
+    fd->cur_index = lblock;
+    fd->cur_gen = fi->gen;
+    return block;
+}
+
+// Makes logical blocks 0 to lblock of a file its own before they are changed,
+// copying whichever of them it still shares with a clone. Copies start at the
+// first shared block, because the FAT entry pointing at it is the first one
+// this file can change without changing the clone. Returns 1 if blocks moved
+// (the caller must look its blocks up again), 0 if none had to, -1 on error.
+// Needs the file's lock held exclusively.
+static int file_unshare(int dir_index, int lblock) {
+    struct file_info *fi = &finfo[dir_index];
+    if (lblock < fi->private_len) {
+        return 0;
+    }
+    pthread_mutex_lock(&meta_lock);
+    int none = shared_blocks == 0;
+    pthread_mutex_unlock(&meta_lock);
+    if (none) {
+        fi->private_len = INT_MAX; // nothing is shared, so all of it is ours
+        return 0;
+    }
+    pthread_mutex_lock(&fi->index_lock);
+    int built = fi->index || file_build_index(dir_index) == 0;
+    pthread_mutex_unlock(&fi->index_lock);
+    if (!built) {
+        return -1;
+    }
+    if (lblock >= fi->index_len) {
+        lblock = fi->index_len - 1;
+    }
+
+    // Find the first shared block and reserve space for the copies
+    pthread_mutex_lock(&meta_lock);
+    int first = fi->private_len;
+    while (first <= lblock && block_refs[fi->index[first]] == 1) {
+        first++;
+    }
+    int count = lblock - first + 1;
+    int full = count > 0 && free_blocks - reserved_blocks < count;
+    if (count > 0 && !full) {
+        reserved_blocks += count;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (count <= 0) {
+        fi->private_len = lblock + 1;
+        return 0;
+    }
+    if (full) {
+        return -1; // Disk is full
+    }
+
+    int chunk = count < max_pending_blocks ? count : max_pending_blocks;
+    int *copies = malloc(count * sizeof(int));
+    char *buf = disk_buffer((size_t) chunk * block_size);
+    int done = 0;
+    int failed = !copies || !buf;
+    while (!failed && done < count) {
+        int len;
+        pthread_mutex_lock(&meta_lock);
+        int goal = done == 0 ? -1 : copies[done - 1] + 1;
+        int start = alloc_extent(goal, count - done < chunk ? count - done : chunk, &len);
+        if (start != -1) {
+            reserved_blocks -= len;
+        }
+        pthread_mutex_unlock(&meta_lock);
+        if (start == -1) {
+            failed = 1;
+            break;
+        }
+        int i;
+        for (i = 0; i < len; i++) {
+            copies[done + i] = start + i;
+        }
+        for (i = 0; i < len; i++) {
+            int block = fi->index[first + done + i];
+            struct cache_entry *e = cache_contains(block) ? cache_get(block, 1) : NULL;
+            if (e) {
+                memcpy(buf + (size_t) i * block_size, e->data, block_size);
+                cache_put(e, 0);
+            } else if (block_read(block, buf + (size_t) i * block_size) < 0) {
+                break;
+            }
+        }
+        done += len;
+        if (i < len || block_write_range(start, len, buf) < 0) {
+            failed = 1;
+        }
+    }
+    free(buf);
+    if (failed) {
+        pthread_mutex_lock(&meta_lock);
+        int i;
+        for (i = 0; copies && i < done; i++) {
+            release_block(copies[i]);
+        }
+        reserved_blocks -= count - done;
+        pthread_mutex_unlock(&meta_lock);
+        free(copies);
+        return -1;
+    }
+
+    // Link the copies in place of the shared blocks. The old blocks lose this
+    // file's reference and are freed if the clone has since let go of them.
+    pthread_mutex_lock(&meta_lock);
+    int next = FAT[fi->index[lblock]];
+    int i;
+    for (i = 0; i < count; i++) {
+        fat_set(copies[i], i == count - 1 ? next : copies[i + 1]);
+        block_refs[copies[i]] = 1;
+    }
+    if (next != -1 && next != 0) {
+        block_ref(next);
+    }
+    if (first == 0) {
+        DIR[dir_index].head = copies[0];
+        dir_changed(dir_index);
+    } else {
+        fat_set(fi->index[first - 1], copies[0]);
+    }
+    block_unref(fi->index[first]);
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_lock(&fi->index_lock);
+    memcpy(fi->index + first, copies, count * sizeof(int));
+    fi->gen++;
+    pthread_mutex_unlock(&fi->index_lock);
+    if (fi->pending_count > 0 && fi->pending_start > first && fi->pending_start <= lblock + 1) {
+        fi->pending_tail = fi->index[fi->pending_start - 1]; // pending blocks go after the copy
+    }
+    free(copies);
+    fi->private_len = lblock + 1;
+    return 1;
+}
+
+// Compression codec: a small LZ77 coder in the style of LZ4, fast enough that
+// compressing costs less than the I/O it saves. The output is a series of
+// sequences: a token byte (literal count in the high nibble, match length
+// minus LZ_MIN_MATCH in the low one, 15 meaning more length bytes follow,
+// each adding up to 255), the literals, a 2-byte little-endian offset back
+// to the match and any extra match length bytes. The last sequence has
+// literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static int lz_put_length(unsigned char *out, int o, int n) {
+    while (n >= 255) {
+        out[o++] = 255;
+        n -= 255;
+    }
+    out[o++] = n;
+    return o;
+}
+
+// Appends one sequence to out; a match length of 0 ends the stream. Returns
+// -1 if it would not fit in cap bytes.
+static int lz_emit(unsigned char *out, int cap, int *pos, const unsigned char *lit, int nlit,
+                   int offset, int mlen) {
+    int o = *pos;
+    if (o + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > cap) {
+        return -1;
+    }
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    out[o++] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15) {
+        o = lz_put_length(out, o, nlit - 15);
+    }
+    memcpy(out + o, lit, nlit);
+    o += nlit;
+    if (mlen) {
+        out[o++] = offset & 0xff;
+        out[o++] = offset >> 8;
+        if (ml >= 15) {
+            o = lz_put_length(out, o, ml - 15);
+        }
+    }
+    *pos = o;
+    return 0;
+}
+
+// Compresses len bytes of src into dst. Returns the compressed size, or -1 if
+// it would take more than cap bytes.
+static int lz_compress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int table[1 << LZ_HASH_BITS]; // last position seen for each hash of 4 bytes
+    memset(table, 0xff, sizeof(table));
+    int anchor = 0; // first byte not yet emitted
+    int o = 0;
+    int i = 0;
+    while (i + LZ_MIN_MATCH <= len) {
+        uint32_t seq;
+        memcpy(&seq, in + i, sizeof(seq));
+        int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h];
+        table[h] = i;
+        if (cand < 0 || i - cand > LZ_MAX_OFFSET || memcmp(in + cand, in + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        int mlen = LZ_MIN_MATCH;
+        while (i + mlen < len && in[cand + mlen] == in[i + mlen]) {
+            mlen++;
+        }
+        if (lz_emit(out, cap, &o, in + anchor, i - anchor, i - cand, mlen) < 0) {
+            return -1;
+        }
+        i += mlen;
+        anchor = i;
+    }
+    if (lz_emit(out, cap, &o, in + anchor, len - anchor, 0, 0) < 0) {
+        return -1;
+    }
+    return o;
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, int n) {
+    unsigned char b;
+    do {
+        if (*ip >= end || n > INT_MAX - 255) {
+            return -1;
+        }
+        b = *(*ip)++;
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+// Decompresses len bytes of src into dst. Returns the decompressed size, or
+// -1 if the input is corrupt or would need more than cap bytes.
+static int lz_decompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *end = ip + len;
+    unsigned char *out = (unsigned char *) dst;
+    int o = 0;
+    while (ip < end) {
+        int token = *ip++;
+        int nlit = token >> 4;
+        if (nlit == 15 && (nlit = lz_get_length(&ip, end, nlit)) < 0) {
+            return -1;
+        }
+        if (nlit > end - ip || nlit > cap - o) {
+            return -1;
+        }
+        memcpy(out + o, ip, nlit);
+        ip += nlit;
+        o += nlit;
+        if (ip == end) {
+            break; // the last sequence has no match
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && (mlen = lz_get_length(&ip, end, mlen)) < 0) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > o || mlen > cap - o) {
+            return -1;
+        }
+        if (offset >= mlen) {
+            memcpy(out + o, out + o - offset, mlen);
+            o += mlen;
+        } else {
+            while (mlen-- > 0) { // overlapping match repeats the last offset bytes
+                out[o] = out[o - offset];
+                o++;
+            }
+        }
+    }
+    return o;
+}
+
+// Compressed files. The data of a file with DIR_COMPRESSED set is cut into
+// clusters of zcluster bytes, and each cluster is stored as one frame: a
+// header followed by the compressed bytes (or the raw ones, if they do not
+// compress), taking as few whole blocks of the chain as that needs. The frame
+// table, built from the headers when the file is first used, gives the chain
+// position each frame starts at. Writes go to one uncompressed cluster in
+// memory that is compressed and stored as a new frame when the writer moves
+// on to another cluster, when it fills up and when the file is flushed.
+#define ZFRAME_MAGIC 0x5a46524d
+
+struct zframe_header {
+    int magic;
+    int raw_len; // bytes of file data in the frame
+    int stored_len; // bytes following the header
+    int compressed; // 0 if those are the raw bytes
+};
+
+struct zfile {
+    int *frames; // chain position of each frame's first block
+    int nframes;
+    int frames_cap;
+    int built; // frames has been read from the headers
+    char *dirty; // cluster being written, zcluster bytes
+    int dirty_cluster; // -1 if there is none
+    int dirty_len; // bytes of file data in it
+    int dirty_reserved; // free blocks promised to its frame
+    char *clean; // the cluster last decompressed for a reader
+    int clean_cluster; // -1 if there is none
+    int clean_len;
+    char *frame; // one stored frame, zframe_max bytes
+};
+
+static int zcluster = ZCLUSTER_BYTES;
+
+static int zframe_blocks(int stored_len) {
+    return (sizeof(struct zframe_header) + stored_len + block_size - 1) / block_size;
+}
+
+static int zframe_max() {
+    return zframe_blocks(zcluster) * block_size;
+}
+
+// Returns the compression state of a file, setting it up on first use. Needs
+// the file's lock held exclusively, or shared together with index_lock.
+static struct zfile *zfile_get(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    if (fi->z) {
+        return fi->z;
+    }
+    struct zfile *z = calloc(1, sizeof(struct zfile));
+    if (!z) {
+        return NULL;
+    }
+    z->dirty = malloc(zcluster);
+    z->clean = malloc(zcluster);
+    z->frame = disk_buffer(zframe_max());
+    if (!z->dirty || !z->clean || !z->frame) {
+        free(z->dirty);
+        free(z->clean);
+        free(z->frame);
+        free(z);
+        return NULL;
+    }
+    z->dirty_cluster = -1;
+    z->clean_cluster = -1;
+    fi->z = z;
+    return z;
+}
+
+// Drops a file's compression state and any unwritten cluster with it.
+static void zfile_free(int dir_index) {
+    struct zfile *z = finfo[dir_index].z;
+    if (!z) {
+        return;
+    }
+    pthread_mutex_lock(&meta_lock);
+    reserved_blocks -= z->dirty_reserved;
+    pthread_mutex_unlock(&meta_lock);
+    free(z->frames);
+    free(z->dirty);
+    free(z->clean);
+    free(z->frame);
+    free(z);
+    finfo[dir_index].z = NULL;
+}
+
+// Reads count blocks of a file's chain, starting at chain position pos, into
+// buf: from the cache when they are there, otherwise a run at a time.
+static int zread_blocks(struct file_info *fi, int pos, int count, char *buf) {
+    int i = 0;
+    while (i < count) {
+        int block = fi->index[pos + i];
+        struct cache_entry *e = cache_contains(block) ? cache_get(block, 1) : NULL;
+        if (e) {
+            memcpy(buf + (size_t) i * block_size, e->data, block_size);
+            cache_put(e, 0);
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < count && fi->index[pos + i + run] == block + run &&
+               !cache_contains(block + run)) {
+            run++;
+        }
+        if (block_read_range(block, run, buf + (size_t) i * block_size) < 0) {
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Reads the header of the frame at chain position pos into h and checks it.
+static int zread_header(struct file_info *fi, int pos, struct zframe_header *h) {
+    struct zfile *z = fi->z;
+    if (zread_blocks(fi, pos, 1, z->frame) < 0) {
+        return -1;
+    }
+    memcpy(h, z->frame, sizeof(*h));
+    if (h->magic != ZFRAME_MAGIC || h->raw_len < 0 || h->raw_len > zcluster ||
+        h->stored_len < 0 || h->stored_len > zcluster ||
+        zframe_blocks(h->stored_len) > fi->index_len - pos) {
+        return -1; // Not a frame
+    }
+    return 0;
+}
+
+// Builds the frame table from the frame headers. Needs index_lock, or the
+// file's lock held exclusively.
+static int zframes_build(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    struct zfile *z = fi->z;
+    if (!fi->index && file_build_index(dir_index) < 0) {
+        return -1;
+    }
+    z->nframes = 0;
+    int pos = 0;
+    while (pos < fi->index_len) {
+        struct zframe_header h;
+        if (zread_header(fi, pos, &h) < 0) {
+            return -1;
+        }
+        if (z->nframes == z->frames_cap) {
+            int cap = z->frames_cap ? z->frames_cap * 2 : 64;
+            int *frames = realloc(z->frames, cap * sizeof(int));
+            if (!frames) {
+                return -1;
+            }
+            z->frames = frames;
+            z->frames_cap = cap;
+        }
+        z->frames[z->nframes++] = pos;
+        pos += zframe_blocks(h.stored_len);
+    }
+    z->built = 1;
+    return 0;
+}
+
+// Decompresses frame number cluster into out. Returns its length in bytes.
+static int zread_frame(struct file_info *fi, int cluster, char *out) {
+    struct zfile *z = fi->z;
+    int pos = z->frames[cluster];
+    struct zframe_header h;
+    if (zread_header(fi, pos, &h) < 0) {
+        return -1;
+    }
+    int nblocks = zframe_blocks(h.stored_len);
+    if (nblocks > 1 && zread_blocks(fi, pos + 1, nblocks - 1, z->frame + block_size) < 0) {
+        return -1;
+    }
+    char *stored = z->frame + sizeof(h);
+    if (!h.compressed) {
+        if (h.stored_len != h.raw_len) {
+            return -1;
+        }
+        memcpy(out, stored, h.raw_len);
+    } else if (lz_decompress(stored, h.stored_len, out, zcluster) != h.raw_len) {
+        return -1; // Corrupt frame
+    }
+    return h.raw_len;
+}
+
+// Compresses the dirty_len bytes in z->dirty into a frame in z->frame. Returns
+// its length in blocks.
+static int zframe_fill(struct zfile *z) {
+    struct zframe_header h = { ZFRAME_MAGIC, z->dirty_len, 0, 1 };
+    char *stored = z->frame + sizeof(h);
+    h.stored_len = lz_compress(z->dirty, z->dirty_len, stored, z->dirty_len - 1);
+    if (h.stored_len < 0) {
+        h.stored_len = z->dirty_len; // does not compress
+        h.compressed = 0;
+        memcpy(stored, z->dirty, z->dirty_len);
+    }
+    memcpy(z->frame, &h, sizeof(h));
+    int nblocks = zframe_blocks(h.stored_len);
+    memset(stored + h.stored_len, 0, (size_t) nblocks * block_size - sizeof(h) - h.stored_len);
+    return nblocks;
+}
+
+// Compresses the cluster being written and stores it as a frame, in place of
+// the frame it had before if any. Needs the file's lock held exclusively.
+static int zfile_flush(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    struct zfile *z = fi->z;
+    if (!z || z->dirty_cluster == -1) {
+        return 0;
+    }
+    int nblocks = zframe_fill(z);
+
+    // The FAT entries on either side of the frame change, so they and
+    // everything before them must not be shared with a clone
+    int cluster = z->dirty_cluster;
+    int pos = cluster < z->nframes ? z->frames[cluster] : fi->index_len;
+    int old = 0;
+    if (cluster < z->nframes) {
+        old = (cluster + 1 < z->nframes ? z->frames[cluster + 1] : fi->index_len) - pos;
+    }
+    if (pos + old > 0 && file_unshare(dir_index, pos + old - 1) < 0) {
+        return -1;
+    }
+    if (cluster == z->nframes && z->nframes == z->frames_cap) {
+        int cap = z->frames_cap ? z->frames_cap * 2 : 64;
+        int *frames = realloc(z->frames, cap * sizeof(int));
+        if (!frames) {
+            return -1;
+        }
+        z->frames = frames;
+        z->frames_cap = cap;
+    }
+    while (fi->index_len + nblocks - old > fi->index_cap) {
+        int cap = fi->index_cap ? fi->index_cap * 2 : 64;
+        int *index = realloc(fi->index, cap * sizeof(int));
+        if (!index) {
+            return -1;
+        }
+        fi->index = index;
+        fi->index_cap = cap;
+    }
+
+    // Write the frame to new blocks, out of the space reserved for it
+    int *blocks = malloc(nblocks * sizeof(int));
+    if (!blocks) {
+        return -1;
+    }
+    int done = 0;
+    int goal = pos > 0 ? fi->index[pos - 1] + 1 : -1;
+    while (done < nblocks) {
+        int len;
+        pthread_mutex_lock(&meta_lock);
+        int start = alloc_extent(goal, nblocks - done, &len);
+        if (start != -1) {
+            reserved_blocks -= len;
+            z->dirty_reserved -= len;
+        }
+        pthread_mutex_unlock(&meta_lock);
+        int i;
+        for (i = 0; start != -1 && i < len; i++) {
+            blocks[done + i] = start + i;
+        }
+        if (start == -1 || block_write_range(start, len, z->frame + (size_t) done * block_size) < 0) {
+            pthread_mutex_lock(&meta_lock);
+            if (start != -1) {
+                done += len;
+            }
+            for (i = 0; i < done; i++) {
+                release_block(blocks[i]);
+            }
+            reserved_blocks += done;
+            z->dirty_reserved += done;
+            pthread_mutex_unlock(&meta_lock);
+            free(blocks);
+            return -1;
+        }
+        done += len;
+        goal = start + len;
+    }
+
+    // Link it in place of the old frame, whose blocks are freed
+    pthread_mutex_lock(&meta_lock);
+    int next = old > 0 ? FAT[fi->index[pos + old - 1]] : -1;
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        fat_set(blocks[i], i == nblocks - 1 ? next : blocks[i + 1]);
+        block_refs[blocks[i]] = 1;
+    }
+    if (pos == 0) {
+        DIR[dir_index].head = blocks[0];
+        dir_changed(dir_index);
+    } else {
+        fat_set(fi->index[pos - 1], blocks[0]);
+    }
+    if (old > 0) {
+        fat_set(fi->index[pos + old - 1], -1);
+        block_unref(fi->index[pos]);
+    }
+    reserved_blocks -= z->dirty_reserved;
+    z->dirty_reserved = 0;
+    pthread_mutex_unlock(&meta_lock);
+
+    memmove(fi->index + pos + nblocks, fi->index + pos + old,
+            (fi->index_len - pos - old) * sizeof(int));
+    memcpy(fi->index + pos, blocks, nblocks * sizeof(int));
+    free(blocks);
+    fi->index_len += nblocks - old;
+    if (fi->private_len != INT_MAX) {
+        fi->private_len += nblocks - old;
+    }
+    fi->gen++;
+    if (cluster == z->nframes) {
+        z->frames[z->nframes++] = pos;
+    }
+    for (i = cluster + 1; i < z->nframes; i++) {
+        z->frames[i] += nblocks - old;
+    }
+
+    // What was written is now the freshest decompressed cluster
+    char *clean = z->clean;
+    z->clean = z->dirty;
+    z->clean_cluster = cluster;
+    z->clean_len = z->dirty_len;
+    z->dirty = clean;
+    z->dirty_cluster = -1;
+    z->dirty_len = 0;
+    return 0;
+}
+
+// Makes cluster the one being written, storing the previous one first.
+static int zload_dirty(int dir_index, int cluster) {
+    struct file_info *fi = &finfo[dir_index];
+    struct zfile *z = fi->z;
+    if (z->dirty_cluster == cluster) {
+        return 0;
+    }
+    if (zfile_flush(dir_index) < 0) {
+        return -1;
+    }
+    int need = zframe_blocks(zcluster);
+    pthread_mutex_lock(&meta_lock);
+    int full = free_blocks - reserved_blocks < need;
+    if (!full) {
+        reserved_blocks += need;
+        z->dirty_reserved = need;
+        if (!fi->pending_listed) {
+            fi->pending_listed = 1;
+            pending_files[pending_files_count++] = dir_index;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (full) {
+        return -1; // Disk is full
+    }
+    int len = 0;
+    if (cluster == z->clean_cluster) {
+        len = z->clean_len;
+        memcpy(z->dirty, z->clean, len);
+    } else if (cluster < z->nframes && (len = zread_frame(fi, cluster, z->dirty)) < 0) {
+        pthread_mutex_lock(&meta_lock);
+        reserved_blocks -= z->dirty_reserved;
+        z->dirty_reserved = 0;
+        pthread_mutex_unlock(&meta_lock);
+        return -1;
+    }
+    memset(z->dirty + len, 0, zcluster - len);
+    z->dirty_cluster = cluster;
+    z->dirty_len = len;
+    return 0;
+}
+
+// Cuts frame number cluster, the last one a truncate leaves, down to its first
+// len bytes. The shorter frame is written over the old frame's first blocks,
+// so no free block is needed; only if it compresses worse than the old one did
+// does it become the cluster being written instead. Returns the number of
+// chain blocks the file keeps, -1 on error. Needs the file's lock held
+// exclusively.
+static int zfile_shorten(int dir_index, int cluster, int len) {
+    struct file_info *fi = &finfo[dir_index];
+    struct zfile *z = fi->z;
+    int pos = z->frames[cluster];
+    int old = (cluster + 1 < z->nframes ? z->frames[cluster + 1] : fi->index_len) - pos;
+    if (cluster == z->clean_cluster) {
+        memcpy(z->dirty, z->clean, len);
+    } else if (zread_frame(fi, cluster, z->dirty) < 0) {
+        return -1;
+    }
+    memset(z->dirty + len, 0, zcluster - len);
+    z->dirty_len = len;
+    int nblocks = zframe_fill(z);
+    if (nblocks > old) {
+        if (zload_dirty(dir_index, cluster) < 0) {
+            return -1; // Disk is full
+        }
+        z->dirty_len = len;
+        memset(z->dirty + len, 0, zcluster - len);
+        return pos + old;
+    }
+    if (file_unshare(dir_index, pos + old - 1) < 0) {
+        return -1; // The frame is shared with a clone and cannot be copied
+    }
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        int block = fi->index[pos + i];
+        cache_invalidate(block);
+        if (block_write(block, z->frame + (size_t) i * block_size) < 0) {
+            return -1;
+        }
+    }
+    z->clean_cluster = -1;
+    return pos + nblocks;
+}
+
+// fs_read for compressed files. Readers share the file's lock, so they take
+// index_lock for the frame table and the decompressed cluster.
+static ssize_t zfile_read(int fildes, void *buf, size_t nbyte) {
+    int dir_index = fildes_array[fildes].file;
+    struct file_info *fi = &finfo[dir_index];
+    off_t offset = fildes_array[fildes].offset;
+    off_t file_size = DIR[dir_index].size;
+    if (offset >= file_size) {
+        return 0; // EOF
+    }
+    if ((off_t) nbyte > file_size - offset) {
+        nbyte = file_size - offset;
+    }
+    size_t done = 0;
+    pthread_mutex_lock(&fi->index_lock);
+    struct zfile *z = zfile_get(dir_index);
+    if (!z || (!z->built && zframes_build(dir_index) < 0)) {
+        pthread_mutex_unlock(&fi->index_lock);
+        return -1;
+    }
+    while (done < nbyte) {
+        int cluster = offset / zcluster;
+        int in = offset % zcluster;
+        char *data;
+        int len;
+        if (cluster == z->dirty_cluster) {
+            data = z->dirty; // written but not stored yet
+            len = z->dirty_len;
+        } else {
+            if (cluster != z->clean_cluster) {
+                if (cluster >= z->nframes) {
+                    break;
+                }
+                z->clean_cluster = -1;
+                if ((z->clean_len = zread_frame(fi, cluster, z->clean)) < 0) {
+                    pthread_mutex_unlock(&fi->index_lock);
+                    return -1;
+                }
+                z->clean_cluster = cluster;
+            }
+            data = z->clean;
+            len = z->clean_len;
+        }
+        if (in >= len) {
+            break;
+        }
+        size_t n = len - in < nbyte - done ? (size_t) (len - in) : nbyte - done;
+        memcpy((char *) buf + done, data + in, n);
+        done += n;
+        offset += n;
+    }
+    pthread_mutex_unlock(&fi->index_lock);
+    fildes_array[fildes].offset = offset;
+    return done;
+}
+
+// fs_write for compressed files.
+static ssize_t zfile_write(int fildes, void *buf, size_t nbyte) {
+    int dir_index = fildes_array[fildes].file;
+    struct zfile *z = zfile_get(dir_index);
+    if (!z) {
+        return -1;
+    }
+    if (!z->built) {
+        pthread_mutex_lock(&finfo[dir_index].index_lock);
+        int built = zframes_build(dir_index);
+        pthread_mutex_unlock(&finfo[dir_index].index_lock);
+        if (built < 0) {
+            return -1;
+        }
+    }
+    off_t offset = fildes_array[fildes].offset;
+    size_t done = 0;
+    while (done < nbyte) {
+        int cluster = offset / zcluster;
+        int in = offset % zcluster;
+        if (zload_dirty(dir_index, cluster) < 0) {
+            break;
+        }
+        size_t n = zcluster - in < nbyte - done ? (size_t) (zcluster - in) : nbyte - done;
+        memcpy(z->dirty + in, (char *) buf + done, n);
+        if (in + (int) n > z->dirty_len) {
+            z->dirty_len = in + n;
+        }
+        if (z->clean_cluster == cluster) {
+            z->clean_cluster = -1;
+        }
+        done += n;
+        offset += n;
+        if (in + (int) n == zcluster) {
+            zfile_flush(dir_index); // a full cluster; on failure it is retried later
+        }
+    }
+    fildes_array[fildes].offset = offset;
+    if (offset > DIR[dir_index].size) {
+        pthread_mutex_lock(&meta_lock);
+        DIR[dir_index].size = offset;
+        dir_changed(dir_index);
+        pthread_mutex_unlock(&meta_lock);
+    }
+    journal_maybe_commit();
+    return done;
+}
+
+// Returns the buffer for logical block lblock of a file's pending data,
+// growing it by one zeroed block if lblock is just past the end. tail is the
+// last disk block of the chain when the file has no pending data yet.
+static char *pending_block(int dir_index, int lblock, int tail) {
+    struct file_info *fi = &finfo[dir_index];
+    if (fi->pending_count == 0) {
+        fi->pending_start = lblock;
+        fi->pending_tail = tail;
+    }
+    int slot = lblock - fi->pending_start;
+    if (slot < fi->pending_count) {
+        return fi->pending + (size_t) slot * block_size;
+    }
+    if (fi->pending_count == fi->pending_cap) {
+        int cap = fi->pending_cap ? fi->pending_cap * 2 : 16;
+        char *pending = disk_buffer((size_t) cap * block_size); // kept aligned for direct I/O
+        if (!pending) {
+            return NULL;
+        }
+        if (fi->pending_count > 0) {
+            memcpy(pending, fi->pending, (size_t) fi->pending_count * block_size);
+        }
+        free(fi->pending);
+        fi->pending = pending;
+        fi->pending_cap = cap;
+    }
+    pthread_mutex_lock(&meta_lock);
+    int full = free_blocks - reserved_blocks <= 0;
+    if (!full) {
+        reserved_blocks++;
+        if (!fi->pending_listed) {
+            fi->pending_listed = 1;
+            pending_files[pending_files_count++] = dir_index;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (full) {
+        return NULL; // Disk is full
+    }
+    char *data = fi->pending + (size_t) slot * block_size;
+    memset(data, 0, block_size);
+    fi->pending_count++;
+    return data;
+}
+
+// Does the file hold written data that has no disk blocks yet?
+static int file_dirty(struct file_info *fi) {
+    return fi->pending_count > 0 || (fi->z && fi->z->dirty_cluster != -1);
+}
+
+// Moves a file's last pending block into its directory entry or a tail block
+// if it is the end of the file and small enough (see tail_alloc). Returns 1
+// if it did, 0 if not, -1 on error. Needs the file's lock held exclusively.
+static int file_pack(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    int len = DIR[dir_index].size % block_size;
+    int last = fi->pending_start + fi->pending_count - 1;
+    if (fi->pending_count == 0 || len == 0 || len > block_size / 2 ||
+        last != DIR[dir_index].size / block_size) {
+        return 0;
+    }
+    char *data = fi->pending + (size_t) (fi->pending_count - 1) * block_size;
+    if (last == 0 && len <= DIR_INLINE_BYTES) {
+        pthread_mutex_lock(&meta_lock);
+        memcpy(DIR[dir_index].data, data, len);
+        DIR[dir_index].flags |= DIR_INLINE;
+        dir_changed(dir_index);
+        reserved_blocks--;
+        pthread_mutex_unlock(&meta_lock);
+        fi->pending_count--;
+        return 1;
+    }
+
+    // The block reserved for the pending block pays for a new tail block.
+    // Tail blocks are written through under meta_lock, so a commit can never
+    // log an entry whose tail is still only in the cache.
+    int offset;
+    int written = 0;
+    pthread_mutex_lock(&meta_lock);
+    reserved_blocks--;
+    int block = tail_alloc(len, &offset);
+    struct cache_entry *e = block == -1 ? NULL : cache_get(block, offset > 0);
+    if (e) {
+        memcpy(e->data + offset, data, len);
+        written = block_write(block, e->data) == 0;
+        cache_put(e, 0);
+    }
+    if (!written) {
+        if (block != -1) {
+            tail_unref(block);
+        }
+        reserved_blocks++;
+        pthread_mutex_unlock(&meta_lock);
+        return -1;
+    }
+    DIR[dir_index].tail.block = block;
+    DIR[dir_index].tail.offset = offset;
+    DIR[dir_index].flags |= DIR_TAIL;
+    dir_changed(dir_index);
+    pthread_mutex_unlock(&meta_lock);
+    fi->pending_count--;
+    return 1;
+}
+
+// Turns a packed end of file back into a pending block, before it is written
+// to or cut. Needs the file's lock held exclusively.
+static int file_unpack(int dir_index) {
+    struct file_info *fi = &finfo[dir_index];
+    if (!(DIR[dir_index].flags & DIR_PACKED)) {
+        return 0;
+    }
+    pthread_mutex_lock(&fi->index_lock);
+    int built = fi->index || file_build_index(dir_index) == 0;
+    pthread_mutex_unlock(&fi->index_lock);
+    if (!built) {
+        return -1;
+    }
+    struct cache_entry *e = NULL;
+    char *packed = DIR[dir_index].data;
+    if (DIR[dir_index].flags & DIR_TAIL) {
+        e = cache_get(DIR[dir_index].tail.block, 1);
+        if (!e) {
+            return -1;
+        }
+        packed = e->data + DIR[dir_index].tail.offset;
+    }
+    int tail = fi->index_len > 0 ? fi->index[fi->index_len - 1] : -1;
+    char *data = pending_block(dir_index, DIR[dir_index].size / block_size, tail);
+    if (data) {
+        memcpy(data, packed, DIR[dir_index].size % block_size);
+    }
+    if (e) {
+        cache_put(e, 0);
+    }
+    if (!data) {
+        return -1; // Disk is full
+    }
+    pthread_mutex_lock(&meta_lock);
+    file_drop_packed(dir_index);
+    pthread_mutex_unlock(&meta_lock);
+    return 0;
+}
+
+// Gives a file's pending blocks disk space, as few extents as the free space
+// allows, writes each extent with one I/O and then appends it to the chain.
+// With pack set, a small last block is packed instead (file_pack). A
+// compressed file stores the cluster it is writing instead. Needs the file's
+// lock held exclusively.
+static int file_flush_pending(int dir_index, int pack) {
+    struct file_info *fi = &finfo[dir_index];
+    int done = 0;
+    int result = 0;
+    if (fi->z) {
+        return zfile_flush(dir_index); // compressed files have no pending blocks
+    }
+    if (pack) {
+        file_pack(dir_index); // a block it cannot pack is flushed as it is
+    }
+    if (fi->pending_count > 0 && fi->pending_tail != -1) {
+        // Appending changes the tail's FAT entry, so the chain must be ours.
+        // Copying the tail moves pending_tail along with it.
+        if (file_unshare(dir_index, fi->pending_start - 1) < 0) {
+            return -1;
+        }
+    }
+    while (done < fi->pending_count) {
+        int goal = fi->pending_tail == -1 ? -1 : fi->pending_tail + 1;
+        int len;
+        pthread_mutex_lock(&meta_lock);
+        int start = alloc_extent(goal, fi->pending_count - done, &len);
+        pthread_mutex_unlock(&meta_lock);
+        if (start == -1) {
+            result = -1;
+            break;
+        }
+        int i;
+        if (block_write_range(start, len, fi->pending + (size_t) done * block_size) < 0) {
+            // Nothing is linked to the extent: give it back, and keep the
+            // data pending, still reserved, for the next flush to retry.
+            pthread_mutex_lock(&meta_lock);
+            for (i = 0; i < len; i++) {
+                release_block(start + i);
+            }
+            pthread_mutex_unlock(&meta_lock);
+            result = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&meta_lock);
+        for (i = 0; i < len; i++) {
+            fat_set(start + i, i == len - 1 ? -1 : start + i + 1);
+            block_refs[start + i] = 1;
+        }
+        if (fi->pending_tail == -1) {
+            DIR[dir_index].head = start;
+            dir_changed(dir_index);
+        } else {
+            fat_set(fi->pending_tail, start);
+        }
+        reserved_blocks -= len;
+        pthread_mutex_unlock(&meta_lock);
+        fi->pending_tail = start + len - 1;
+        for (i = 0; i < len; i++) {
+            if (fi->index && fi->index_len == fi->pending_start + done + i &&
+                index_append(fi, start + i) < 0) {
+                file_forget_blocks(dir_index);
+            }
+        }
+        done += len;
+    }
+    fi->pending_count -= done;
+    fi->pending_start += done;
+    if (fi->pending_count > 0) {
+        memmove(fi->pending, fi->pending + (size_t) done * block_size,
+                (size_t) fi->pending_count * block_size);
+    } else {
+        free(fi->pending);
+        fi->pending = NULL;
+        fi->pending_cap = 0;
+    }
+    return result;
+}
+
+static int flush_all_pending() {
+    pthread_mutex_lock(&meta_lock);
+    int count = pending_files_count;
+    int *files = malloc((count + 1) * sizeof(int));
+    if (!files) {
+        pthread_mutex_unlock(&meta_lock);
+        return -1;
+    }
+    memcpy(files, pending_files, count * sizeof(int));
+    int i;
+    for (i = 0; i < count; i++) {
+        finfo[files[i]].pending_listed = 0;
+    }
+    pending_files_count = 0;
+    pthread_mutex_unlock(&meta_lock);
+
+    int result = 0;
+    for (i = 0; i < count; i++) {
+        struct file_info *fi = &finfo[files[i]];
+        pthread_rwlock_wrlock(&fi->lock);
+        if (file_dirty(fi) && file_flush_pending(files[i], 1) < 0) {
+            result = -1;
+        }
+        if (file_dirty(fi)) {
+            pthread_mutex_lock(&meta_lock);
+            if (!fi->pending_listed) {
+                fi->pending_listed = 1; // try again next time
+                pending_files[pending_files_count++] = files[i];
+            }
+            pthread_mutex_unlock(&meta_lock);
+        }
+        pthread_rwlock_unlock(&fi->lock);
+    }
+    free(files);
+    return result;
+}
+
+// Name lookup. Directory slots are hashed by parent directory and name into
+// dir_buckets and chained through dir_hnext, so a lookup costs the same
+// however many entries there are. Unused slots are kept on the dir_free
+// stack. All of it is built at mount and guarded by dir_lock.
+static int *dir_buckets = NULL;
+static int *dir_hnext = NULL;
+static int *dir_free = NULL;
+static int dir_free_count = 0;
+
+static unsigned int dir_hash(int parent, const char *name) {
+    unsigned int h = 2166136261u ^ (unsigned int) parent; // FNV-1a
+    while (*name) {
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    }
+    return h % dir_slots; // one bucket per slot
+}
+
+// Returns the slot of the entry called name in directory parent, or -1.
+static int dir_find(int parent, const char *name) {
+    int i = dir_buckets[dir_hash(parent, name)];
+    while (i != -1 && (DIR[i].parent != parent || strcmp(DIR[i].name, name) != 0)) {
+        i = dir_hnext[i];
+    }
+    return i;
+}
+
+static void dir_index_insert(int slot) {
+    unsigned int h = dir_hash(DIR[slot].parent, DIR[slot].name);
+    dir_hnext[slot] = dir_buckets[h];
+    dir_buckets[h] = slot;
+}
+
+static void dir_index_remove(int slot) {
+    int *p = &dir_buckets[dir_hash(DIR[slot].parent, DIR[slot].name)];
+    while (*p != -1) {
+        if (*p == slot) {
+            *p = dir_hnext[slot];
+            return;
+        }
+        p = &dir_hnext[*p];
+    }
+}
+
+static int dir_index_build() {
+    dir_buckets = malloc(dir_slots * sizeof(int));
+    dir_hnext = malloc(dir_slots * sizeof(int));
+    dir_free = malloc(dir_slots * sizeof(int));
+    if (!dir_buckets || !dir_hnext || !dir_free || DIR[ROOT_DIR].used != DIR_DIRECTORY) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < dir_slots; i++) {
+        dir_buckets[i] = -1;
+    }
+    dir_free_count = 0;
+    for (i = dir_slots - 1; i >= 0; i--) {
+        dir_hnext[i] = -1;
+        if (!DIR[i].used) {
+            dir_free[dir_free_count++] = i; // lowest slots are handed out first
+        } else if (i != ROOT_DIR) {
+            if (DIR[i].parent < 0 || DIR[i].parent >= dir_slots) {
+                return -1;
+            }
+            dir_index_insert(i);
+            finfo[DIR[i].parent].children++;
+        }
+    }
+    return 0;
+}
+
+static void dir_index_destroy() {
+    free(dir_buckets);
+    free(dir_hnext);
+    free(dir_free);
+    dir_buckets = NULL;
+    dir_hnext = NULL;
+    dir_free = NULL;
+    dir_free_count = 0;
+}
+
+// Walks path down from the root up to its last component, which is copied to
+// name. Components are separated by '/'; a leading '/' is optional. Returns
+// the slot of the directory holding the last component, or -1 if one on the
+// way is missing or not a directory, or a component is empty or too long.
+static int path_parent(const char *path, char *name) {
+    int dir = ROOT_DIR;
+    if (*path == '/') {
+        path++;
+    }
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t) (end - path) : strlen(path);
+        if (len == 0 || len > MAX_F_NAME) {
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        if (!end) {
+            return dir;
+        }
+        dir = dir_find(dir, name);
+        if (dir == -1 || DIR[dir].used != DIR_DIRECTORY) {
+            return -1;
+        }
+        path = end + 1;
+    }
+}
+
+// Returns the slot path names, ROOT_DIR for "/" or "", or -1.
+static int path_lookup(const char *path) {
+    char name[MAX_F_NAME + 1];
+    if (strcmp(path, "/") == 0 || *path == '\0') {
+        return ROOT_DIR;
+    }
+    int parent = path_parent(path, name);
+    return parent == -1 ? -1 : dir_find(parent, name);
+}
+
+// Locks open descriptor fildes and the file it refers to, the file shared
+// unless exclusive is set. Returns the file's state, or NULL with nothing
+// locked if fildes is not open.
+static struct file_info *file_enter(int fildes, int exclusive) {
+    if (fildes < 0 || fildes >= MAX_FILDES) {
+        return NULL;
+    }
+    pthread_mutex_lock(&fildes_array[fildes].lock);
+    if (!fildes_array[fildes].is_used) {
+        pthread_mutex_unlock(&fildes_array[fildes].lock);
+        return NULL;
+    }
+    struct file_info *fi = &finfo[fildes_array[fildes].file];
+    if (exclusive) {
+        pthread_rwlock_wrlock(&fi->lock);
+    } else {
+        pthread_rwlock_rdlock(&fi->lock);
+    }
+    return fi;
+}
+
+static void file_leave(int fildes, struct file_info *fi) {
+    pthread_rwlock_unlock(&fi->lock);
+    pthread_mutex_unlock(&fildes_array[fildes].lock);
+}
+
+// Readahead. A read that starts where the descriptor's previous read ended
+// is sequential; while that holds, a window of blocks past the reader is kept
+// queued for the prefetch thread, which loads them into the cache while the
+// caller is busy with what it already has. The window starts at
+// READAHEAD_MIN_BLOCKS and doubles every time it is topped up; any other
+// read drops it to nothing again.
+#define PREFETCH_QUEUE 64 // requests waiting for the prefetch thread
+
+struct prefetch_request {
+    int file; // directory slot the blocks belong to
+    int gen; // file_info gen when the request was made
+    int block; // first disk block of a run of adjacent blocks
+    int count;
+};
+
+static struct prefetch_request prefetch_requests[PREFETCH_QUEUE];
+static int prefetch_head = 0;
+static int prefetch_count = 0;
+static pthread_t prefetcher;
+static int prefetcher_running = 0;
+static int prefetcher_stop = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static void prefetch_enqueue(int file, int gen, int block, int count) {
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetcher_running && prefetch_count < PREFETCH_QUEUE) {
+        struct prefetch_request *r = &prefetch_requests[(prefetch_head + prefetch_count) % PREFETCH_QUEUE];
+        r->file = file;
+        r->gen = gen;
+        r->block = block;
+        r->count = count;
+        prefetch_count++;
+        pthread_cond_signal(&prefetch_cond);
+    } // a full queue just means less readahead
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+static void *prefetch_main(void *arg) {
+    pthread_mutex_lock(&prefetch_lock);
+    while (!prefetcher_stop) {
+        if (prefetch_count == 0) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+            continue;
+        }
+        struct prefetch_request r = prefetch_requests[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+        prefetch_count--;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        // Holding the file's lock shared keeps its chain as it was when the
+        // request was made, unless gen says it has been cut since
+        pthread_rwlock_rdlock(&fs_lock);
+        if (fs_mounted) {
+            struct file_info *fi = &finfo[r.file];
+            pthread_rwlock_rdlock(&fi->lock);
+            if (fi->gen == r.gen) {
+                cache_prefetch(r.block, r.count);
+            }
+            pthread_rwlock_unlock(&fi->lock);
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        pthread_mutex_lock(&prefetch_lock);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return NULL;
+}
+
+static int prefetch_start() {
+    pthread_mutex_lock(&prefetch_lock);
+    int result = 0;
+    if (!prefetcher_running) {
+        prefetch_head = 0;
+        prefetch_count = 0;
+        prefetcher_stop = 0;
+        if (pthread_create(&prefetcher, NULL, prefetch_main, NULL) == 0) {
+            prefetcher_running = 1;
+        } else {
+            result = -1; // reads still work, just without readahead
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return result;
+}
+
+static void prefetch_stop() {
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetcher_running) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    prefetcher_stop = 1;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+    pthread_join(prefetcher, NULL);
+    pthread_mutex_lock(&prefetch_lock);
+    prefetcher_running = 0;
+    prefetch_count = 0;
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Called at the end of a read that left the descriptor at logical block
+// lblock, held in disk block block. Tops the readahead window up once the
+// reader has used half of it.
+static void readahead(int fildes, int sequential, int lblock, int block) {
+    struct file_descriptor *fd = &fildes_array[fildes];
+    struct file_info *fi = &finfo[fd->file];
+    if (!sequential) {
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+        return;
+    }
+    if (fd->ra_window == 0) {
+        fd->ra_window = READAHEAD_MIN_BLOCKS;
+        fd->ra_end = lblock;
+    }
+    if (fd->ra_end < lblock) {
+        fd->ra_end = lblock; // the reader overtook the prefetch thread
+    }
+    if (fd->ra_end - lblock > fd->ra_window / 2 || block <= 0 || block_ptr(block)) {
+        return; // enough queued already, nothing left on disk, or no I/O to hide
+    }
+
+    int last = lblock + fd->ra_window;
+    int nblocks = (DIR[fd->file].size + block_size - 1) / block_size;
+    if (fi->pending_count > 0 && fi->pending_start < nblocks) {
+        nblocks = fi->pending_start; // pending data is in memory already
+    }
+    if (last > nblocks) {
+        last = nblocks;
+    }
+    int at = lblock;
+    while (at < fd->ra_end && block > 0) {
+        block = FAT[block];
+        at++;
+    }
+    while (at < last && block > 0) {
+        int count = 1;
+        while (at + count < last && FAT[block + count - 1] == block + count) {
+            count++;
+        }
+        prefetch_enqueue(fd->file, fi->gen, block, count);
+        at += count;
+        block = FAT[block + count - 1];
+    }
+    fd->ra_end = at;
+
+    int max = cache_size / 2 < READAHEAD_MAX_BLOCKS ? cache_size / 2 : READAHEAD_MAX_BLOCKS;
+    fd->ra_window *= 2;
+    if (fd->ra_window > max) {
+        fd->ra_window = max > 0 ? max : 1;
+    }
+}
+
+static int do_make_fs(char *disk_name, off_t disk_size, int bsize) {
+    if (bsize <= 0 || disk_size / bsize <= 0 || disk_size / bsize > INT_MAX) {
+        return -1; // Bad geometry
+    }
+    block_size = bsize;
+    disk_blocks = disk_size / bsize;
+
+    free(fs);
+    fs = disk_buffer(block_size); // the superblock is written out as a whole block
+    if (!fs) {
+        return -1;
+    }
+    fs->fat_idx = 1; // FAT starts at block 1
+    fs->fat_len = ((size_t) disk_blocks * sizeof(int) + block_size - 1) / block_size; // FAT length in blocks
+    fs->dir_idx = fs->fat_idx + fs->fat_len; // Directory starts after FAT
+    int slots = disk_blocks < MAX_FILES / 2 ? disk_blocks * 2 : MAX_FILES;
+    fs->dir_len = (slots + DIR_PER_BLOCK - 1) / DIR_PER_BLOCK; // Directory length in blocks
+    fs->journal_idx = fs->dir_idx + fs->dir_len; // Journal follows the directory
+    fs->journal_len = JOURNAL_BYTES / block_size > 2 ? JOURNAL_BYTES / block_size : 2;
+    fs->journal_seq = 1;
+    fs->data_idx = fs->journal_idx + fs->journal_len; // File data after that
+    fs->block_size = block_size;
+    fs->disk_blocks = disk_blocks;
+    if (fs->data_idx >= disk_blocks) {
+        return -1; // No room left for data
+    }
+    dir_slots = fs->dir_len * DIR_PER_BLOCK;
+
+    FAT = disk_buffer((size_t) fs->fat_len * block_size); // read and written as whole blocks
+    DIR = disk_buffer((size_t) fs->dir_len * block_size);
+    if (!FAT || !DIR) {
+        free(FAT);
+        free(DIR);
+        return -1;
+    }
+
+    if (make_disk_geometry(disk_name, disk_blocks, block_size) < 0) {
+        return -1; // Failed to create or open the disk
+    }
+
+    if (open_disk(disk_name) < 0 || disk_set_geometry(disk_blocks, block_size) < 0) {
+        return -1; // Failed to open the disk
+    }
+
+    DIR[ROOT_DIR].used = DIR_DIRECTORY;
+    strcpy(DIR[ROOT_DIR].name, "/");
+    DIR[ROOT_DIR].head = -1;
+    DIR[ROOT_DIR].parent = -1;
+
+    // write the superblock, FAT and directory to disk
+    if (write_metadata(1) < 0) {
+        return -1;
+    }
+    if (close_disk() < 0) {
+        return -1; // Failed to close the disk
+    }
+    free(FAT);
+    free(DIR);
+    FAT = NULL;
+    DIR = NULL;
+    return 0; // Success
+}
+
+static int do_mount_fs(char *disk_name) {
+    if (open_disk(disk_name) < 0) {
+        return -1; // Failed to open the disk
+    }
+    // The superblock sits at the start of the disk whatever the block size,
+    // so it can be read before the geometry it records is known
+    char *super = disk_buffer(BLOCK_SIZE);
+    if (!super || block_read(0, super) < 0) {
+        free(super);
+        return -1; // Failed to read the superblock
+    }
+    struct super_block *sb = (struct super_block *) super;
+    if (sb->block_size <= 0 || disk_set_geometry(sb->disk_blocks, sb->block_size) < 0) {
+        free(super);
+        close_disk();
+        return -1; // Not a file system, or made by an older version
+    }
+    block_size = sb->block_size;
+    disk_blocks = sb->disk_blocks;
+    free(fs);
+    fs = disk_buffer(block_size);
+    if (!fs) {
+        free(super);
+        return -1;
+    }
+    memcpy(fs, super, sizeof(struct super_block));
+    free(super);
+    dir_slots = fs->dir_len * DIR_PER_BLOCK;
+
+    FAT = disk_buffer((size_t) fs->fat_len * block_size);
+    if (!FAT || block_read_range(fs->fat_idx, fs->fat_len, (char *) FAT) < 0) {
+        return -1;
+    }
+    DIR = disk_buffer((size_t) fs->dir_len * block_size);
+    if (!DIR || block_read_range(fs->dir_idx, fs->dir_len, (char *) DIR) < 0) {
+        return -1;
+    }
+
+    fat_block_dirty = calloc(fs->fat_len, 1);
+    dir_block_dirty = calloc(fs->dir_len, 1);
+    fat_committed = disk_buffer((size_t) fs->fat_len * block_size);
+    dir_committed = disk_buffer((size_t) fs->dir_len * block_size);
+    if (!fat_block_dirty || !dir_block_dirty || !fat_committed || !dir_committed) {
+        return -1;
+    }
+
+    // Bring the FAT and directory up to date with committed journal groups
+    journal_head = 0;
+    journal_next_seq = fs->journal_seq;
+    int replayed = fs->journal_len > 0 ? journal_replay() : 0;
+    memcpy(fat_committed, FAT, (size_t) fs->fat_len * block_size);
+    memcpy(dir_committed, DIR, (size_t) fs->dir_len * block_size);
+    if (replayed > 0) {
+        memset(fat_block_dirty, 1, fs->fat_len);
+        memset(dir_block_dirty, 1, fs->dir_len);
+        if (checkpoint() < 0) {
+            return -1;
+        }
+    }
+    dirty_fat = malloc(disk_blocks * sizeof(int));
+    fat_logged = calloc(disk_blocks, 1);
+    dirty_dir = malloc(dir_slots * sizeof(int));
+    dir_logged = calloc(dir_slots, 1);
+    pending_files = malloc(dir_slots * sizeof(int));
+    freed_map = calloc((disk_blocks + 63) / 64, sizeof(uint64_t));
+    if (!dirty_fat || !fat_logged || !dirty_dir || !dir_logged || !pending_files || !freed_map) {
+        return -1;
+    }
+    freed_count = 0;
+    dirty_fat_count = 0;
+    dirty_dir_count = 0;
+
+    int i;
+    for(i = 0; i < MAX_FILDES; i++) {
+        fildes_array[i].is_used = 0;
+    }
+    if (free_map_build() < 0 || block_refs_build() < 0) {
+        return -1;
+    }
+    finfo = calloc(dir_slots, sizeof(struct file_info));
+    if (!finfo) {
+        return -1;
+    }
+    pending_files_count = 0;
+    max_pending_blocks = MAX_PENDING_BYTES / block_size > 0 ? MAX_PENDING_BYTES / block_size : 1;
+    zcluster = ZCLUSTER_BYTES > block_size ? ZCLUSTER_BYTES : block_size;
+    for (i = 0; i < dir_slots; i++) {
+        pthread_rwlock_init(&finfo[i].lock, NULL);
+        pthread_mutex_init(&finfo[i].index_lock, NULL);
+        finfo[i].private_len = shared_blocks == 0 ? INT_MAX : 0;
+    }
+    if (dir_index_build() < 0) {
+        return -1;
+    }
+    int cache_blocks = cache_wanted;
+    if (cache_blocks == 0) {
+        cache_blocks = DEFAULT_CACHE_BYTES / block_size > 8 ? DEFAULT_CACHE_BYTES / block_size : 8;
+    }
+    if (cache_init(cache_blocks) < 0) {
+        return -1;
+    }
+    fs_mounted = 1;
+    return 0;
+}
+
+static int do_umount_fs(char *disk_name) {
+    int i;
+    if (flush_all_pending() < 0 || cache_flush() < 0) {
+        return -1; // Failed to write back file data
+    }
+    if (journal_commit() < 0 || checkpoint() < 0) {
+        return -1; // Failed to write superblock, FAT or directory
+    }
+    cache_destroy();
+    free(dirty_fat);
+    free(fat_logged);
+    free(dirty_dir);
+    free(dir_logged);
+    free(pending_files);
+    free(freed_map);
+    dirty_fat = NULL;
+    fat_logged = NULL;
+    dirty_dir = NULL;
+    dir_logged = NULL;
+    pending_files = NULL;
+    freed_map = NULL;
+    free(fat_block_dirty);
+    free(dir_block_dirty);
+    free(fat_committed);
+    free(dir_committed);
+    fat_block_dirty = NULL;
+    dir_block_dirty = NULL;
+    fat_committed = NULL;
+    dir_committed = NULL;
+    free_map_destroy();
+    free(block_refs);
+    block_refs = NULL;
+    for (i = 0; i < dir_slots; i++) {
+        free(finfo[i].index);
+        free(finfo[i].pending);
+        zfile_free(i);
+        pthread_rwlock_destroy(&finfo[i].lock);
+        pthread_mutex_destroy(&finfo[i].index_lock);
+    }
+    free(finfo);
+    finfo = NULL;
+    dir_index_destroy();
+    for (i = 0; i < MAX_FILDES; i++) {
+        fildes_array[i].is_used = 0;
+    }
+    if (close_disk() < 0) {
+        return -1; // Failed to close the disk
+    }
+    free(FAT);
+    free(DIR);
+    FAT = NULL;
+    DIR = NULL;
+    fs_mounted = 0;
+    return 0;
+}
+
+static int do_fs_sync() {
+    if (!fs_mounted) {
+        return -1;
+    }
+    if (flush_all_pending() < 0) {
+        return -1; // Failed to allocate or write delayed blocks
+    }
+    if (cache_flush() < 0) {
+        return -1; // Failed to write back dirty data blocks
+    }
+    pthread_mutex_lock(&meta_lock);
+    int result = 0;
+    if (journal_commit() < 0) {
+        result = -1; // Failed to log the metadata changes
+    } else if (fs->journal_len > 0 && journal_head * 2 > fs->journal_len && checkpoint() < 0) {
+        result = -1; // Failed to write back the changed FAT and directory blocks
+    } else if (disk_flush() < 0) {
+        result = -1; // Failed to get the writes onto stable storage
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return result;
+}
+
+static int do_fs_set_cache_size(int nblocks) {
+    if (nblocks <= 0) {
+        return -1;
+    }
+    cache_wanted = nblocks;
+    if (!fs_mounted) {
+        return 0;
+    }
+    if (cache_flush() < 0) {
+        return -1;
+    }
+    int old_size = cache_size;
+    cache_destroy();
+    if (cache_init(nblocks) < 0) {
+        cache_init(old_size);
+        return -1;
+    }
+    return 0;
+}
+
+// Takes a free descriptor for the file in slot dir_index. Needs dir_lock.
+static int fd_claim(int dir_index) {
+    int i;
+    for (i = 0; i < MAX_FILDES; i++) {
+        // A descriptor locked by someone else is open, or just being closed
+        if (pthread_mutex_trylock(&fildes_array[i].lock) != 0) {
+            continue;
+        }
+        if (fildes_array[i].is_used == 0) {
+            fildes_array[i].is_used = 1;
+            fildes_array[i].file = dir_index;
+            fildes_array[i].offset = 0;
+            fildes_array[i].cur_block = -1;
+            fildes_array[i].ra_offset = 0;
+            fildes_array[i].ra_window = 0;
+            fildes_array[i].ra_end = 0;
+            pthread_mutex_unlock(&fildes_array[i].lock);
+            pthread_mutex_lock(&meta_lock);
+            finfo[dir_index].ref_cnt++;
+            pthread_mutex_unlock(&meta_lock);
+            return i; // Return the file descriptor
+        }
+        pthread_mutex_unlock(&fildes_array[i].lock);
+    }
+    return -1; // No free file descriptors
+}
+
+static int do_fs_open(char *name) {
+    int dir_index = path_lookup(name);
+    if (dir_index == -1 || DIR[dir_index].used != DIR_FILE) {
+        return -1; // File not found
+    }
+    return fd_claim(dir_index);
+}
+
+static int do_fs_close(int fildes) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+    int dir_index = fildes_array[fildes].file;
+    // The descriptor goes even if this fails; the delayed blocks stay with the
+    // file, to be retried by fs_sync or dropped by fs_delete
+    int flushed = !file_dirty(&finfo[dir_index]) || file_flush_pending(dir_index, 1) == 0;
+    fildes_array[fildes].is_used = 0;
+    fildes_array[fildes].file = 0;
+    fildes_array[fildes].offset = 0;
+    pthread_mutex_lock(&meta_lock);
+    finfo[dir_index].ref_cnt--;
+    pthread_mutex_unlock(&meta_lock);
+    // The file's metadata goes out with the next group; committing here would
+    // cost every close a disk flush
+    journal_maybe_commit();
+    if (!flushed) {
+        return -1; // Failed to write delayed blocks
+    }
+    return 0; // Success
+}
+
+// Adds an empty entry of the given type (DIR_FILE or DIR_DIRECTORY) at path.
+static int dir_add(char *path, int type) {
+    char name[MAX_F_NAME + 1];
+    int parent = path_parent(path, name);
+    if (parent == -1) {
+        return -1; // Bad path or file name too long
+    }
+    if (dir_find(parent, name) != -1) {
+        return -1; // File already exists
+    }
+    if (dir_free_count == 0) {
+        return -1; // No free directory slots
+    }
+    int dir_index = dir_free[--dir_free_count];
+
+    pthread_mutex_lock(&meta_lock);
+    DIR[dir_index].used = type;
+    strcpy(DIR[dir_index].name, name);
+    DIR[dir_index].size = 0;
+    DIR[dir_index].head = -1;
+    DIR[dir_index].parent = parent;
+    dir_changed(dir_index);
+    pthread_mutex_unlock(&meta_lock);
+    dir_index_insert(dir_index);
+    finfo[parent].children++;
+    journal_maybe_commit();
+    
+    return 0; // Success
+}
+
+static int do_fs_create(char *name) {
+    return dir_add(name, DIR_FILE);
+}
+
+static int do_fs_mkdir(char *name) {
+    return dir_add(name, DIR_DIRECTORY);
+}
+
+static int do_fs_delete(char *name) {
+    int dir_index = path_lookup(name);
+    if (dir_index == -1 || dir_index == ROOT_DIR) {
+        return -1; // File not found
+    }
+    if (finfo[dir_index].children > 0) {
+        return -1; // Directory is not empty
+    }
+    // Opening needs dir_lock, so once ref_cnt is 0 here it stays 0
+    pthread_mutex_lock(&meta_lock);
+    int in_use = finfo[dir_index].ref_cnt > 0;
+    pthread_mutex_unlock(&meta_lock);
+    if (in_use) {
+        return -1; // File is open
+    }
+
+    struct file_info *fi = &finfo[dir_index];
+    pthread_rwlock_wrlock(&fi->lock); // wait out a close that is still flushing
+    // Only metadata changes: the blocks keep their old contents until they
+    // are discarded or reused, and a reused block is always written in full
+    // before anything can read it
+    dir_index_remove(dir_index);
+    finfo[DIR[dir_index].parent].children--;
+    dir_free[dir_free_count++] = dir_index;
+    pthread_mutex_lock(&meta_lock);
+    block_unref(DIR[dir_index].head); // Mark the file's blocks as free
+    file_drop_packed(dir_index);
+    DIR[dir_index].used = 0;
+    DIR[dir_index].flags = 0;
+    memset(DIR[dir_index].name, '\0', MAX_F_NAME + 1);
+    DIR[dir_index].size = 0;
+    DIR[dir_index].head = -1;
+    DIR[dir_index].parent = -1;
+    dir_changed(dir_index);
+    pthread_mutex_unlock(&meta_lock);
+    file_forget_blocks(dir_index);
+    zfile_free(dir_index);
+    pthread_rwlock_unlock(&fi->lock);
+    journal_maybe_commit();
+    return 0; // Success
+}
+
+// Makes dst a copy of the file src without copying any data: the new entry
+// points at the same chain and each file copies blocks away from the other
+// only when it changes them (see file_unshare).
+static int do_fs_clone(char *src, char *dst) {
+    int src_index = path_lookup(src);
+    if (src_index == -1 || DIR[src_index].used != DIR_FILE) {
+        return -1; // File not found
+    }
+    struct file_info *fi = &finfo[src_index];
+    pthread_rwlock_wrlock(&fi->lock);
+    if (file_dirty(fi) && file_flush_pending(src_index, 1) < 0) {
+        pthread_rwlock_unlock(&fi->lock);
+        return -1; // The clone would miss the delayed blocks
+    }
+    if (dir_add(dst, DIR_FILE) < 0) {
+        pthread_rwlock_unlock(&fi->lock);
+        return -1;
+    }
+    int dst_index = path_lookup(dst);
+
+    pthread_mutex_lock(&meta_lock);
+    DIR[dst_index].head = DIR[src_index].head;
+    DIR[dst_index].size = DIR[src_index].size;
+    DIR[dst_index].flags = DIR[src_index].flags;
+    memcpy(DIR[dst_index].data, DIR[src_index].data, DIR_INLINE_BYTES); // a packed end is shared too
+    dir_changed(dst_index);
+    if (DIR[src_index].head > 0) {
+        block_ref(DIR[src_index].head);
+    }
+    if (DIR[src_index].flags & DIR_TAIL) {
+        block_refs[DIR[src_index].tail.block]++;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    fi->private_len = 0;
+    finfo[dst_index].private_len = 0;
+    pthread_rwlock_unlock(&fi->lock);
+    journal_maybe_commit();
+    return 0;
+}
+
+// Turns compression on or off for a file. Only empty files can switch, so a
+// file's data is always stored one way.
+static int do_fs_set_compression(char *name, int on) {
+    int dir_index = path_lookup(name);
+    if (dir_index == -1 || DIR[dir_index].used != DIR_FILE) {
+        return -1; // File not found
+    }
+    struct file_info *fi = &finfo[dir_index];
+    pthread_rwlock_wrlock(&fi->lock);
+    int empty = DIR[dir_index].size == 0 && !file_dirty(fi);
+    if (empty) {
+        zfile_free(dir_index);
+        pthread_mutex_lock(&meta_lock);
+        if (on) {
+            DIR[dir_index].flags |= DIR_COMPRESSED;
+        } else {
+            DIR[dir_index].flags &= ~DIR_COMPRESSED;
+        }
+        dir_changed(dir_index);
+        pthread_mutex_unlock(&meta_lock);
+    }
+    pthread_rwlock_unlock(&fi->lock);
+    if (!empty) {
+        return -1; // File has data
+    }
+    journal_maybe_commit();
+    return 0;
+}
+
+// Counts how many of the next max blocks of a chain, starting at block, sit
+// next to each other on disk and are not in the cache, so they can be moved
+// with one I/O straight to or from the caller's buffer.
+static int uncached_run(int block, int max) {
+    int len = 0;
+    while (len < max && !cache_contains(block + len)) {
+        len++;
+        if (FAT[block + len - 1] != block + len) {
+            break;
+        }
+    }
+    return len;
+}
+
+static ssize_t do_fs_read(int fildes, void *buf, size_t nbyte) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+
+    int dir_index = fildes_array[fildes].file;
+    if (DIR[dir_index].flags & DIR_COMPRESSED) {
+        return zfile_read(fildes, buf, nbyte);
+    }
+    struct file_info *fi = &finfo[dir_index];
+    off_t offset = fildes_array[fildes].offset;
+    off_t file_size = DIR[dir_index].size;
+    size_t num_bytes_read = 0;
+    int sequential = offset == fildes_array[fildes].ra_offset;
+
+    // Check if we are at the end of the file
+    if (offset >= file_size) {
+        return 0; // EOF
+    }
+
+    // Find the starting block from the descriptor's cursor
+    int lblock = offset / block_size;
+    int on_disk = fi->pending_count == 0 || lblock < fi->pending_start;
+    int current_block = on_disk ? fd_block(fildes, lblock) : -1;
+    int block_offset = offset % block_size;
+
+    // Read the file
+    while(num_bytes_read < nbyte) {
+        off_t bytes_left = file_size - (offset + (off_t) num_bytes_read);
+        if (bytes_left <= 0) {
+            break;
+        }
+
+        char *data;
+        struct cache_entry *e = NULL;
+        if (fi->pending_count > 0 && lblock >= fi->pending_start) {
+            // Not allocated yet, still in memory
+            data = fi->pending + (size_t) (lblock - fi->pending_start) * block_size;
+        } else if ((current_block == -1 || current_block == 0) &&
+                   DIR[dir_index].flags & DIR_PACKED) {
+            // The packed end of the file
+            if (DIR[dir_index].flags & DIR_INLINE) {
+                data = DIR[dir_index].data;
+            } else {
+                e = cache_get(DIR[dir_index].tail.block, 1);
+                if (!e) {
+                    return -1;
+                }
+                data = e->data + DIR[dir_index].tail.offset;
+            }
+        } else {
+            if (current_block == -1 || current_block == 0) {
+                break;
+            }
+            off_t want = bytes_left < (off_t) (nbyte - num_bytes_read) ? bytes_left : (off_t) (nbyte - num_bytes_read);
+            int whole_blocks = want / block_size < INT_MAX ? want / block_size : INT_MAX;
+            if (block_offset == 0 && whole_blocks > 1) {
+                int run = uncached_run(current_block, whole_blocks);
+                if (run > 1) {
+                    // Read the run directly into the caller's buffer
+                    if (block_read_range(current_block, run, (char *) buf + num_bytes_read) < 0) {
+                        return -1;
+                    }
+                    num_bytes_read += (size_t) run * block_size;
+                    lblock += run;
+                    current_block += run - 1;
+                    fildes_array[fildes].cur_block = current_block;
+                    fildes_array[fildes].cur_index = lblock - 1;
+                    current_block = FAT[current_block];
+                    continue;
+                }
+            }
+            fildes_array[fildes].cur_block = current_block;
+            fildes_array[fildes].cur_index = lblock;
+            if (!cache_contains(current_block) && (data = block_ptr(current_block))) {
+                // Memory-backed disk: copy straight out of the image
+            } else {
+                e = cache_get(current_block, 1);
+                if (!e) {
+                    return -1;
+                }
+                data = e->data;
+            }
+            current_block = FAT[current_block];
+        }
+
+        int bytes_to_read = block_size - block_offset;
+        if (bytes_to_read > bytes_left) {
+            bytes_to_read = (int) bytes_left;
+        }
+        if (bytes_to_read > nbyte - num_bytes_read) {
+            bytes_to_read = nbyte - num_bytes_read;
+        }
+
+        memcpy((char *)buf + num_bytes_read, data + block_offset, bytes_to_read);
+        if (e) {
+            cache_put(e, 0);
+        }
+        num_bytes_read += bytes_to_read;
+        block_offset = 0;
+        lblock++;
+    }
+    fildes_array[fildes].offset += num_bytes_read;
+    fildes_array[fildes].ra_offset = fildes_array[fildes].offset;
+    readahead(fildes, sequential, lblock, current_block);
+    return num_bytes_read;
+}
+
+int get_next_block() {
+    pthread_mutex_lock(&meta_lock);
+    int block = alloc_block();
+    pthread_mutex_unlock(&meta_lock);
+    return block;
+}
+
+static ssize_t do_fs_write(int fildes, void *buf, size_t nbyte) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+
+    // Check if disk is full
+    pthread_mutex_lock(&meta_lock);
+    int available = free_blocks - reserved_blocks;
+    pthread_mutex_unlock(&meta_lock);
+    if (available <= 0) {
+        return 0; // Disk is full
+    }
+    off_t free_bytes = (off_t) available * block_size;
+    if ((off_t) nbyte > free_bytes) {
+        nbyte = free_bytes;
+    }
+
+    int dir_index = fildes_array[fildes].file;
+    struct file_info *fi = &finfo[dir_index];
+    off_t offset = fildes_array[fildes].offset;
+    size_t num_bytes_written = 0;
+
+    // Check if we are at the end of the file; logical block numbers are ints
+    off_t max_size = (off_t) INT_MAX * block_size;
+    if (offset >= max_size) {
+        return 0;
+    }
+    if ((off_t) nbyte > max_size - offset) {
+        nbyte = max_size - offset;
+    }
+
+    if (nbyte == 0) {
+        return 0;
+    }
+    if (DIR[dir_index].flags & DIR_COMPRESSED) {
+        return zfile_write(fildes, buf, nbyte);
+    }
+    if (DIR[dir_index].flags & DIR_PACKED &&
+        offset + (off_t) nbyte > DIR[dir_index].size / block_size * block_size &&
+        file_unpack(dir_index) < 0) {
+        return -1; // The packed end of the file could not be made a block again
+    }
+
+    int lblock = offset / block_size;
+    int block_offset = offset % block_size;
+    int on_disk = fi->pending_count == 0 || lblock < fi->pending_start;
+    int current_block = on_disk ? fd_block(fildes, lblock) : -1;
+    int prev_block = -1;
+    if (on_disk && current_block == -1 && lblock > 0) {
+        // The offset sits right after the last block of the chain
+        prev_block = fd_block(fildes, lblock - 1);
+    }
+
+    // Write the file
+    while(num_bytes_written < nbyte) {
+        int bytes_to_write = block_size - block_offset;
+        if (bytes_to_write > nbyte - num_bytes_written) {
+            bytes_to_write = nbyte - num_bytes_written;
+        }
+
+        char *data;
+        struct cache_entry *e = NULL;
+        if (current_block == -1 || current_block == 0) {
+            if (fi->pending_count == 0 && lblock > 0) {
+                // The pending blocks will hang off the end of the chain, so take
+                // it from any clone now, while the write can still fail
+                int moved = file_unshare(dir_index, lblock - 1);
+                if (moved < 0) {
+                    if (num_bytes_written == 0) {
+                        return -1; // No room to copy the shared blocks
+                    }
+                    break;
+                }
+                if (moved) {
+                    prev_block = fd_block(fildes, lblock - 1);
+                }
+            }
+            // Past the end of the chain: buffer it until the file is flushed
+            data = pending_block(dir_index, lblock, prev_block);
+            if (!data) {
+                break;
+            }
+        } else {
+            size_t want = (nbyte - num_bytes_written) / block_size;
+            int whole_blocks = want < INT_MAX ? want : INT_MAX;
+            if (block_offset == 0 && whole_blocks > 1) {
+                // Overwrite a run of existing blocks straight from the caller's buffer
+                int run = 1;
+                while (run < whole_blocks && FAT[current_block + run - 1] == current_block + run) {
+                    run++;
+                }
+                int moved = run > 1 ? file_unshare(dir_index, lblock + run - 1) : 0;
+                if (moved < 0) {
+                    break;
+                }
+                if (moved) {
+                    current_block = fd_block(fildes, lblock); // copied away from a clone
+                    continue;
+                }
+                if (run > 1) {
+                    int i;
+                    for (i = 0; i < run; i++) {
+                        cache_invalidate(current_block + i);
+                    }
+                    if (block_write_range(current_block, run, (char *) buf + num_bytes_written) < 0) {
+                        break;
+                    }
+                    num_bytes_written += (size_t) run * block_size;
+                    fildes_array[fildes].offset += (off_t) run * block_size;
+                    lblock += run;
+                    current_block += run - 1;
+                    fildes_array[fildes].cur_block = current_block;
+                    fildes_array[fildes].cur_index = lblock - 1;
+                    prev_block = current_block;
+                    current_block = FAT[current_block];
+                    continue;
+                }
+            }
+            int moved = file_unshare(dir_index, lblock);
+            if (moved < 0) {
+                break;
+            }
+            if (moved) {
+                current_block = fd_block(fildes, lblock);
+            }
+            fildes_array[fildes].cur_block = current_block;
+            fildes_array[fildes].cur_index = lblock;
+            // Only partially overwritten blocks need their old contents
+            e = cache_get(current_block, bytes_to_write < block_size);
+            if (!e) {
+                break;
+            }
+            data = e->data;
+            prev_block = current_block;
+            current_block = FAT[current_block];
+        }
+        memcpy(data + block_offset, (char *) buf + num_bytes_written, bytes_to_write);
+        if (e) {
+            cache_put(e, 1);
+        }
+        num_bytes_written += bytes_to_write;
+        fildes_array[fildes].offset += bytes_to_write;
+        block_offset = 0;
+        lblock++;
+    }
+
+    if (fildes_array[fildes].offset > DIR[dir_index].size) {
+        pthread_mutex_lock(&meta_lock);
+        DIR[dir_index].size = fildes_array[fildes].offset;
+        dir_changed(dir_index);
+        pthread_mutex_unlock(&meta_lock);
+    }
+
+    if (fi->pending_count >= max_pending_blocks) {
+        file_flush_pending(dir_index, 0); // whatever is left is retried on close or sync
+    }
+    journal_maybe_commit();
+    return num_bytes_written;
+}
+
+static off_t do_fs_get_filesize(int fildes) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+    return DIR[fildes_array[fildes].file].size;
+}
+
+static int do_fs_listdir(char *name, char ***files) {
+    int dir = path_lookup(name);
+    if (dir == -1 || DIR[dir].used != DIR_DIRECTORY) {
+        return -1; // Directory not found
+    }
+    char **file_list = malloc((finfo[dir].children + 1) * sizeof(char *));
+    if (!file_list) {
+        return -1;
+    }
+    int count = 0;
+    int i;
+    for(i = 0; i < dir_slots && count < finfo[dir].children; i++) {
+        if (DIR[i].used && DIR[i].parent == dir && i != ROOT_DIR) {
             file_list[count] = malloc(MAX_F_NAME + 1);
             strcpy(file_list[count], DIR[i].name);
             count++;
         }
     }
-    file_list[count] = NULL;
-    *files = file_list;
+    file_list[count] = NULL;
+    *files = file_list;
+    return 0;
+}
+
+static int do_fs_listfiles(char ***files) {
+    return do_fs_listdir("/", files);
+}
+
+static int do_fs_lseek(int fildes, off_t offset) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+    if (offset < 0 || offset > DIR[fildes_array[fildes].file].size) {
+        return -1; // Invalid offset
+    }
+    fildes_array[fildes].offset = offset;
+    fd_block(fildes, offset / block_size); // move the block cursor along with the offset
+    return 0;
+}
+
+static int do_fs_truncate(int fildes, off_t length) {
+    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
+        return -1; // Invalid or closed file descriptor
+    }
+    int dir_index = fildes_array[fildes].file;
+    if (length < 0 || length > DIR[dir_index].size) {
+        return -1; // Invalid length
+    }
+    struct file_info *fi = &finfo[dir_index];
+    if (DIR[dir_index].flags & DIR_PACKED) {
+        // Cut the packed end where it is instead of unpacking it, which would
+        // need a free block
+        off_t packed_start = DIR[dir_index].size / block_size * block_size;
+        pthread_mutex_lock(&meta_lock);
+        if (length > packed_start) {
+            if (DIR[dir_index].flags & DIR_INLINE) {
+                memset(DIR[dir_index].data + length, 0, DIR_INLINE_BYTES - length);
+            }
+            DIR[dir_index].size = length;
+            dir_changed(dir_index);
+            pthread_mutex_unlock(&meta_lock);
+            fildes_array[fildes].offset = length;
+            journal_maybe_commit();
+            return 0;
+        }
+        file_drop_packed(dir_index);
+        DIR[dir_index].size = packed_start;
+        pthread_mutex_unlock(&meta_lock);
+    }
+    if (file_dirty(fi) && file_flush_pending(dir_index, 0) < 0) {
+        return -1;
+    }
+
+    // Keep the blocks that still hold data, zero the rest of the last one
+    int keep = (length + block_size - 1) / block_size;
+    int compressed = DIR[dir_index].flags & DIR_COMPRESSED;
+    if (compressed) {
+        // Keep the frames that still hold data; a cluster cut in two is
+        // shortened where it is (zfile_shorten)
+        struct zfile *z = zfile_get(dir_index);
+        if (!z) {
+            return -1;
+        }
+        if (!z->built) {
+            pthread_mutex_lock(&fi->index_lock);
+            int built = zframes_build(dir_index);
+            pthread_mutex_unlock(&fi->index_lock);
+            if (built < 0) {
+                return -1;
+            }
+        }
+        int clusters = (length + zcluster - 1) / zcluster;
+        keep = clusters < z->nframes ? z->frames[clusters] : fi->index_len;
+        if (length % zcluster != 0 &&
+            (keep = zfile_shorten(dir_index, clusters - 1, length % zcluster)) < 0) {
+            return -1;
+        }
+    }
+    if (keep > 0 && file_unshare(dir_index, keep - 1) < 0) {
+        return -1; // The new last block is shared with a clone and cannot be copied
+    }
+    if (compressed) {
+        struct zfile *z = fi->z;
+        int clusters = (length + zcluster - 1) / zcluster;
+        if (z->nframes > clusters) {
+            z->nframes = clusters;
+        }
+        z->clean_cluster = -1;
+    }
+    int prev = keep == 0 ? -1 : fd_block(fildes, keep - 1);
+    int current_block = prev == -1 ? DIR[dir_index].head : FAT[prev];
+    if (length % block_size != 0 && !compressed) {
+        struct cache_entry *e = cache_get(prev, 1);
+        if (!e) {
+            return -1;
+        }
+        memset(e->data + length % block_size, '\0', block_size - length % block_size);
+        cache_put(e, 1);
+    }
+
+    // Release the blocks past the new end of file
+    pthread_mutex_lock(&meta_lock);
+    if (prev == -1) {
+        DIR[dir_index].head = -1;
+    } else {
+        fat_set(prev, -1);
+    }
+    block_unref(current_block);
+    DIR[dir_index].size = length;
+    dir_changed(dir_index);
+    pthread_mutex_unlock(&meta_lock);
+    if (fi->index_len > keep) {
+        fi->index_len = keep;
+    }
+    fi->gen++;
+    fildes_array[fildes].offset = length;
+    journal_maybe_commit();
     return 0;
 }
 
-int fs_lseek(int fildes, off_t offset) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
+// Memory mappings (fs_mmap). A read-only mapping of a run of adjacent blocks
+// is a view of the disk image itself (block_map). Any other mapping is
+// anonymous memory read in full from the file when it is made, so touching it
+// never needs the file system: there is no fault handling, and mapped memory
+// can be given to fs_read and fs_write like any other buffer. A writable
+// mapping keeps a copy of its pages as last read or written back; writing it
+// back writes the pages that no longer match. Each mapping does its I/O
+// through a descriptor of its own, which also keeps the file from being
+// deleted.
+#define MAX_MAPPINGS 64
+
+struct mapping {
+    char *base; // start of the mapped pages, NULL if the slot is free
+    size_t len; // bytes from base, a whole number of pages
+    char *addr; // what fs_mmap returned, inside the first page
+    off_t offset; // file offset of base
+    int fildes; // descriptor used for the mapping's I/O
+    int owner; // descriptor fs_mmap was given, -1 once it was closed
+    int prot;
+    int view; // blocks mapped from block_map, this many; 0 if read in
+    char *copy; // writable mappings: the pages as the file last had them
+    unsigned char *unsaved; // per page: its last write-back failed
+};
+
+static struct mapping mappings[MAX_MAPPINGS];
+static size_t page_size = 0;
+// Held across a mapping's setup and write-backs; taken before fs_lock.
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reads or writes len bytes of the mapped file at off through the mapping's
+// descriptor. Writes stop at the end of the file, which mappings never move.
+static int map_io(struct mapping *m, int write, char *buf, off_t off, size_t len) {
+    int result = -1;
+    pthread_rwlock_rdlock(&fs_lock);
+    struct file_info *fi = fs_mounted ? file_enter(m->fildes, write) : NULL;
+    if (fi) {
+        off_t size = DIR[fildes_array[m->fildes].file].size;
+        if (write && off + (off_t) len > size) {
+            len = off < size ? size - off : 0;
+        }
+        fildes_array[m->fildes].offset = off;
+        if (len == 0) {
+            result = 0;
+        } else if (write) {
+            result = do_fs_write(m->fildes, buf, len) == (ssize_t) len ? 0 : -1;
+        } else {
+            result = do_fs_read(m->fildes, buf, len) < 0 ? -1 : 0;
+        }
+        file_leave(m->fildes, fi);
     }
-    if (offset < 0 || offset > DIR[fildes_array[fildes].file].size) {
-        return -1; // Invalid offset
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+// Writes the changed pages of m back to the file. Needs map_lock. The page is
+// copied first, so writes made to it meanwhile show up as a change next time.
+static int map_writeback(struct mapping *m) {
+    int result = 0;
+    size_t i;
+    for (i = 0; m->copy && i < m->len / page_size; i++) {
+        char *page = m->base + i * page_size;
+        char *copy = m->copy + i * page_size;
+        if (!m->unsaved[i] && memcmp(page, copy, page_size) == 0) {
+            continue;
+        }
+        memcpy(copy, page, page_size);
+        m->unsaved[i] = map_io(m, 1, copy, m->offset + (off_t) (i * page_size), page_size) < 0;
+        if (m->unsaved[i]) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Closes a descriptor fs_mmap opened for a mapping.
+static void map_close_fildes(int fildes) {
+    pthread_rwlock_rdlock(&fs_lock);
+    struct file_info *fi = fs_mounted ? file_enter(fildes, 1) : NULL;
+    if (fi) {
+        do_fs_close(fildes);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+// Writes m back and removes it. Needs map_lock.
+static int map_release(struct mapping *m) {
+    int result = map_writeback(m);
+    if (m->view) {
+        pthread_rwlock_rdlock(&fs_lock);
+        block_unmap(m->base, m->view);
+        pthread_rwlock_unlock(&fs_lock);
+    } else {
+        munmap(m->base, m->len);
+    }
+    map_close_fildes(m->fildes);
+    free(m->copy);
+    free(m->unsaved);
+    memset(m, 0, sizeof(*m));
+    return result;
+}
+
+// Sets up a view of the image for a read-only mapping of len bytes at offset
+// when the file's blocks there are adjacent. Needs fildes locked exclusively.
+static char *map_view(struct mapping *m, int fildes, off_t offset, size_t len) {
+    int dir_index = fildes_array[fildes].file;
+    struct file_info *fi = &finfo[dir_index];
+    if (DIR[dir_index].flags & DIR_COMPRESSED || offset + (off_t) len > DIR[dir_index].size) {
+        return NULL;
+    }
+    if (file_dirty(fi) && file_flush_pending(dir_index, 0) < 0) {
+        return NULL;
+    }
+    int first = offset / block_size;
+    int count = (offset + len - 1) / block_size - first + 1;
+    int block = fd_block(fildes, first);
+    int i;
+    for (i = 1; block > 0 && i < count; i++) {
+        if (FAT[block + i - 1] != block + i) {
+            return NULL; // not one run: read the pages in instead
+        }
+    }
+    // The view shows the disk, so cached changes have to be there first
+    if (block <= 0 || cache_flush() < 0) {
+        return NULL;
+    }
+    char *base = block_map(block, count);
+    if (base) {
+        m->base = base;
+        m->len = (size_t) count * block_size;
+        m->offset = (off_t) first * block_size;
+        m->view = count;
+    }
+    return base;
+}
+
+static void *do_fs_mmap(int fildes, off_t offset, size_t length, int prot) {
+    struct mapping *m = NULL;
+    int i;
+    for (i = 0; i < MAX_MAPPINGS && !m; i++) {
+        if (!mappings[i].base) {
+            m = &mappings[i];
+        }
+    }
+    if (!m) {
+        return NULL; // Too many mappings
+    }
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    // A descriptor of the mapping's own
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    struct file_info *fi = fs_mounted ? file_enter(fildes, 0) : NULL;
+    int dir_index = fi ? fildes_array[fildes].file : -1;
+    if (fi) {
+        file_leave(fildes, fi);
+    }
+    int own = dir_index == -1 ? -1 : fd_claim(dir_index);
+    pthread_mutex_unlock(&dir_lock);
+    if (own == -1) {
+        pthread_rwlock_unlock(&fs_lock);
+        return NULL; // Bad descriptor, or none left for the mapping
+    }
+    char *addr = NULL;
+    if (prot == PROT_READ) {
+        fi = file_enter(own, 1);
+        if (fi && map_view(m, own, offset, length)) {
+            addr = m->base + (offset - m->offset);
+        }
+        if (fi) {
+            file_leave(own, fi);
+        }
+    }
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (!addr) {
+        m->offset = offset - offset % page_size;
+        m->len = (offset - m->offset + length + page_size - 1) / page_size * page_size;
+        m->fildes = own;
+        m->base = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (prot & PROT_WRITE) {
+            m->copy = malloc(m->len);
+            m->unsaved = calloc(m->len / page_size, 1);
+        }
+        // All read in now; past the end of the file the pages stay zero
+        if (m->base == MAP_FAILED || ((prot & PROT_WRITE) && (!m->copy || !m->unsaved)) ||
+            map_io(m, 0, m->base, m->offset, m->len) < 0 ||
+            ((prot & PROT_WRITE) == 0 && mprotect(m->base, m->len, PROT_READ) < 0)) {
+            free(m->copy);
+            free(m->unsaved);
+            if (m->base != MAP_FAILED) {
+                munmap(m->base, m->len);
+            }
+            memset(m, 0, sizeof(*m));
+            map_close_fildes(own);
+            return NULL;
+        }
+        if (m->copy) {
+            memcpy(m->copy, m->base, m->len);
+        }
+        addr = m->base + (offset - m->offset);
+    }
+    m->addr = addr;
+    m->fildes = own;
+    m->owner = fildes;
+    m->prot = prot;
+    return addr;
+}
+
+// Online defragmentation. fs_defrag moves fragmented files, a slice of
+// blocks per call, into runs of free blocks long enough to hold them whole.
+// A file bigger than a slice is moved piece by piece over several calls, its
+// chain staying whole in between: the pieces moved so far, then the rest
+// where it was. Each piece is copied to its new blocks first and then linked
+// in place of the old ones by one journal group, so a crash leaves the file
+// in either place. Files sharing blocks with a clone or mapped as a view are
+// left alone. The state below is guarded by dir_lock.
+static int defrag_slot = 0; // next directory slot to look at
+static int defrag_file = -1; // file being moved, -1 if none
+static int defrag_target = 0; // first block of the run it is moving to
+static int defrag_len = 0; // its length in blocks
+static int defrag_done = 0; // blocks already moved there
+
+// Counts the runs of adjacent blocks in a file's chain.
+static int file_extents(int dir_index, int *blocks) {
+    int extents = 0;
+    int count = 0;
+    int block = DIR[dir_index].head;
+    while (block != -1 && block != 0) {
+        int next = FAT[block];
+        if (next != block + 1) {
+            extents++;
+        }
+        count++;
+        block = next;
+    }
+    *blocks = count;
+    return extents;
+}
+
+// Is file dir_index mapped straight from the disk? Needs map_lock.
+static int file_has_view(int dir_index) {
+    int i;
+    for (i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].base && mappings[i].view &&
+            fildes_array[mappings[i].fildes].file == dir_index) {
+            return 1;
+        }
     }
-    fildes_array[fildes].offset = offset;
     return 0;
 }
 
-int fs_truncate(int fildes, off_t length) {
-    if (fildes < 0 || fildes >= MAX_FILDES || fildes_array[fildes].is_used == 0) {
-        return -1; // Invalid or closed file descriptor
+// Picks the file to move next and the run to move it to, looking at up to
+// *slots directory slots from defrag_slot on. Returns 0 if none of them can
+// be moved. Needs map_lock and dir_lock.
+static int defrag_pick(int *slots) {
+    while (*slots > 0) {
+        (*slots)--;
+        int slot = defrag_slot;
+        defrag_slot = (defrag_slot + 1) % dir_slots;
+        if (DIR[slot].used != DIR_FILE || file_has_view(slot)) {
+            continue;
+        }
+        struct file_info *fi = &finfo[slot];
+        pthread_rwlock_wrlock(&fi->lock);
+        if (file_dirty(fi) && file_flush_pending(slot, 1) < 0) {
+            pthread_rwlock_unlock(&fi->lock);
+            continue;
+        }
+        int blocks;
+        int extents = file_extents(slot, &blocks);
+        int start = -1;
+        int len = 0;
+        if (extents > 1) {
+            pthread_mutex_lock(&meta_lock);
+            int shared = 0;
+            int block = DIR[slot].head;
+            while (!shared && block != -1 && block != 0) {
+                shared = block_refs[block] > 1;
+                block = FAT[block];
+            }
+            if (!shared) {
+                start = find_free_run(blocks, &len);
+            }
+            pthread_mutex_unlock(&meta_lock);
+        }
+        pthread_rwlock_unlock(&fi->lock);
+        if (start != -1 && len >= blocks) {
+            defrag_file = slot;
+            defrag_target = start;
+            defrag_len = blocks;
+            defrag_done = 0;
+            return 1;
+        }
     }
-    if (length < 0 || length > DIR[fildes_array[fildes].file].size) {
-        return -1; // Invalid length
+    return 0;
+}
+
+// Moves the next count blocks of defrag_file to their place in its run.
+// Returns how many were moved, 0 if the file has to be picked again because
+// it or the free space changed since, -1 on error.
+static int defrag_move(int count) {
+    int dir_index = defrag_file;
+    struct file_info *fi = &finfo[dir_index];
+    int done = defrag_done;
+    int target = defrag_target + done;
+    pthread_rwlock_wrlock(&fi->lock);
+    if (DIR[dir_index].used != DIR_FILE || file_dirty(fi)) {
+        pthread_rwlock_unlock(&fi->lock);
+        return 0;
+    }
+    pthread_mutex_lock(&fi->index_lock);
+    int built = fi->index || file_build_index(dir_index) == 0;
+    pthread_mutex_unlock(&fi->index_lock);
+    if (!built) {
+        pthread_rwlock_unlock(&fi->lock);
+        return -1;
+    }
+    if (fi->index_len != defrag_len || (done > 0 && fi->index[done - 1] != target - 1)) {
+        pthread_rwlock_unlock(&fi->lock);
+        return 0; // written or truncated since
     }
 
-    char block_buf[BLOCK_SIZE];
-    int file_size = DIR[fildes_array[fildes].file].size;
+    // Take the blocks, unless someone else got there first
+    pthread_mutex_lock(&meta_lock);
     int i;
-    int start_block = fildes_array[fildes].file;
-    for(i = file_size; i >= length; i--) {
-        block_read(start_block + i/BLOCK_SIZE, block_buf);
-        memset(block_buf + (i % BLOCK_SIZE), '\0', 1);
-        block_write(start_block + i/BLOCK_SIZE, block_buf);
+    int taken = free_blocks - reserved_blocks < count;
+    for (i = 0; !taken && i < done + count; i++) {
+        taken = block_refs[fi->index[i]] > 1; // cloned since
+    }
+    for (i = 0; !taken && i < count; i++) {
+        taken = !block_is_free(target + i);
+    }
+    int len = 0;
+    if (!taken) {
+        int cursor = alloc_cursor; // keep other allocations off the rest of the run
+        alloc_extent(target, count, &len);
+        alloc_cursor = cursor;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (taken) {
+        pthread_rwlock_unlock(&fi->lock);
+        return 0;
+    }
+
+    char *buf = disk_buffer((size_t) count * block_size);
+    int failed = !buf;
+    i = 0;
+    while (!failed && i < count) {
+        int block = fi->index[done + i];
+        struct cache_entry *e = cache_contains(block) ? cache_get(block, 1) : NULL;
+        if (e) {
+            memcpy(buf + (size_t) i * block_size, e->data, block_size);
+            cache_put(e, 0);
+            i++;
+            continue;
+        }
+        int run = uncached_run(block, count - i);
+        if (block_read_range(block, run, buf + (size_t) i * block_size) < 0) {
+            failed = 1;
+        }
+        i += run;
+    }
+    if (failed || block_write_range(target, count, buf) < 0) {
+        free(buf);
+        pthread_mutex_lock(&meta_lock);
+        for (i = 0; i < count; i++) {
+            release_block(target + i);
+        }
+        pthread_mutex_unlock(&meta_lock);
+        pthread_rwlock_unlock(&fi->lock);
+        return -1;
+    }
+    free(buf);
+
+    // Link the copies in place of the old blocks and commit that as one group
+    pthread_mutex_lock(&meta_lock);
+    int next = FAT[fi->index[done + count - 1]];
+    for (i = 0; i < count; i++) {
+        fat_set(target + i, i == count - 1 ? next : target + i + 1);
+        block_refs[target + i] = 1;
+    }
+    if (next != -1 && next != 0) {
+        block_ref(next);
+    }
+    if (done == 0) {
+        DIR[dir_index].head = target;
+        dir_changed(dir_index);
+    } else {
+        fat_set(target - 1, target);
+    }
+    block_unref(fi->index[done]);
+    int result = journal_commit();
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_lock(&fi->index_lock);
+    for (i = 0; i < count; i++) {
+        fi->index[done + i] = target + i;
+    }
+    fi->gen++;
+    pthread_mutex_unlock(&fi->index_lock);
+    pthread_rwlock_unlock(&fi->lock);
+    return result < 0 ? -1 : count;
+}
+
+// Moves up to max_blocks blocks. Returns how many, 0 when there is nothing
+// left that can be moved.
+static int do_fs_defrag(int max_blocks) {
+    if (!fs_mounted || max_blocks <= 0) {
+        return -1;
+    }
+    int moved = 0;
+    int slots = dir_slots; // one pass over the directory at most
+    while (moved < max_blocks) {
+        if (defrag_file == -1 && !defrag_pick(&slots)) {
+            break;
+        }
+        int count = defrag_len - defrag_done;
+        if (count > max_blocks - moved) {
+            count = max_blocks - moved;
+        }
+        if (count > max_pending_blocks) {
+            count = max_pending_blocks;
+        }
+        int result = defrag_move(count);
+        if (result < 0) {
+            defrag_file = -1;
+            return moved > 0 ? moved : -1;
+        }
+        defrag_done += result;
+        moved += result;
+        if (result == 0 || defrag_done == defrag_len) {
+            defrag_file = -1;
+        }
+    }
+    return moved;
+}
+
+// Adds up the extents of every file for fs_fragmentation.
+static int do_fs_fragmentation(struct fs_fragmentation *out) {
+    if (!fs_mounted) {
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    int i;
+    for (i = 0; i < dir_slots; i++) {
+        if (DIR[i].used != DIR_FILE) {
+            continue;
+        }
+        struct file_info *fi = &finfo[i];
+        pthread_rwlock_rdlock(&fi->lock);
+        int blocks;
+        int extents = file_extents(i, &blocks);
+        pthread_rwlock_unlock(&fi->lock);
+        if (blocks == 0) {
+            continue;
+        }
+        out->files++;
+        out->blocks += blocks;
+        out->extents += extents;
+        if (extents > 1) {
+            out->fragmented_files++;
+        }
+    }
+    pthread_mutex_lock(&meta_lock);
+    out->free_blocks = free_blocks;
+    int len;
+    find_free_run(disk_blocks, &len);
+    out->free_run = len;
+    pthread_mutex_unlock(&meta_lock);
+    return 0;
+}
+
+// Background flusher: syncs the file system every flush_interval_ms until it
+// is stopped or the file system is unmounted.
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+static int flush_interval_ms = 0;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+static void *flusher_main(void *arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval_ms / 1000;
+        deadline.tv_nsec += (long) (flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline) == 0 || flusher_stop) {
+            continue;
+        }
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_rwlock_rdlock(&fs_lock);
+        if (fs_mounted) {
+            do_fs_sync(); // a failed sync is retried on the next tick
+        }
+        pthread_rwlock_unlock(&fs_lock);
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+int fs_start_flusher(int interval_ms) {
+    if (interval_ms <= 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&flusher_lock);
+    if (flusher_running) {
+        flush_interval_ms = interval_ms; // takes effect after the current wait
+        pthread_mutex_unlock(&flusher_lock);
+        return 0;
+    }
+    flush_interval_ms = interval_ms;
+    flusher_stop = 0;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        pthread_mutex_unlock(&flusher_lock);
+        return -1;
+    }
+    flusher_running = 1;
+    pthread_mutex_unlock(&flusher_lock);
+    return 0;
+}
+
+int fs_stop_flusher() {
+    pthread_mutex_lock(&flusher_lock);
+    if (!flusher_running) {
+        pthread_mutex_unlock(&flusher_lock);
+        return 0;
+    }
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = 0;
+    return 0;
+}
+
+// Accounts one call of op that started at start and returned result.
+static void stats_op(int op, uint64_t start, ssize_t result) {
+    struct fs_op_stats *st = &stats.op[op];
+    unsigned long long ns = stats_clock() - start;
+    unsigned long long max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    unsigned long long us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (bucket >= FS_LAT_BUCKETS) {
+        bucket = FS_LAT_BUCKETS - 1;
+    }
+    stats_count(&st->calls, 1);
+    stats_count(&st->total_ns, ns);
+    stats_count(&st->hist[bucket], 1);
+    if (result < 0) {
+        stats_count(&st->errors, 1);
+    } else if (op == FS_OP_READ || op == FS_OP_WRITE) {
+        stats_count(&st->bytes, result);
+    }
+    while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+int fs_stats(struct fs_stats *out) {
+    if (!out) {
+        return -1;
+    }
+    unsigned long long *from = (unsigned long long *) &stats;
+    unsigned long long *to = (unsigned long long *) out;
+    size_t i;
+    for (i = 0; i < sizeof(stats) / sizeof(*from); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int fs_reset_stats() {
+    unsigned long long *counters = (unsigned long long *) &stats;
+    size_t i;
+    for (i = 0; i < sizeof(stats) / sizeof(*counters); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
-    fildes_array[fildes].offset = length;
-    DIR[fildes_array[fildes].file].size = length;
     return 0;
-}
\ No newline at end of file
+}
+
+// Public entry points. Each takes fs_lock, and whichever of the finer locks
+// the call needs, around the do_ function that does the work.
+
+int make_fs(char *disk_name) {
+    return make_fs_geometry(disk_name, (off_t) DISK_BLOCKS * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+int make_fs_geometry(char *disk_name, off_t disk_size, int bsize) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = do_make_fs(disk_name, disk_size, bsize);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+int mount_fs(char *disk_name) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = do_mount_fs(disk_name);
+    defrag_slot = 0; // a different directory to go through
+    defrag_file = -1;
+    pthread_rwlock_unlock(&fs_lock);
+    if (result == 0) {
+        prefetch_start();
+    }
+    return result;
+}
+
+int umount_fs(char *disk_name) {
+    int i;
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].base) {
+            map_release(&mappings[i]);
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    fs_stop_flusher();
+    prefetch_stop();
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = do_umount_fs(disk_name);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+int fs_sync() {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = do_fs_sync();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_SYNC, start, result);
+    return result;
+}
+
+int fs_set_cache_size(int nblocks) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = do_fs_set_cache_size(nblocks);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+int fs_open(char *name) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_open(name);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_OPEN, start, result);
+    return result;
+}
+
+int fs_close(int fildes) {
+    uint64_t start = stats_clock();
+    int i, result = 0;
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].base && mappings[i].owner == fildes) {
+            result |= map_writeback(&mappings[i]);
+            mappings[i].owner = -1;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    pthread_rwlock_rdlock(&fs_lock);
+    if (result < 0) {
+        pthread_rwlock_unlock(&fs_lock);
+        stats_op(FS_OP_CLOSE, start, result);
+        return -1; // Failed to write back mapped pages
+    }
+    result = -1;
+    struct file_info *fi = file_enter(fildes, 1);
+    if (fi) {
+        result = do_fs_close(fildes);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_CLOSE, start, result);
+    return result;
+}
+
+int fs_create(char *name) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_create(name);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_CREATE, start, result);
+    return result;
+}
+
+int fs_mkdir(char *name) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_mkdir(name);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_MKDIR, start, result);
+    return result;
+}
+
+int fs_delete(char *name) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_delete(name);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_DELETE, start, result);
+    return result;
+}
+
+int fs_clone(char *src, char *dst) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_clone(src, dst);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_CLONE, start, result);
+    return result;
+}
+
+int fs_set_compression(char *name, int on) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_set_compression(name, on);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+ssize_t fs_read(int fildes, void *buf, size_t nbyte) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    ssize_t result = -1;
+    struct file_info *fi = file_enter(fildes, 0);
+    if (fi) {
+        result = do_fs_read(fildes, buf, nbyte);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_READ, start, result);
+    return result;
+}
+
+ssize_t fs_write(int fildes, void *buf, size_t nbyte) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    ssize_t result = -1;
+    struct file_info *fi = file_enter(fildes, 1);
+    if (fi) {
+        result = do_fs_write(fildes, buf, nbyte);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_WRITE, start, result);
+    return result;
+}
+
+off_t fs_get_filesize(int fildes) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    off_t result = -1;
+    struct file_info *fi = file_enter(fildes, 0);
+    if (fi) {
+        result = do_fs_get_filesize(fildes);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_FILESIZE, start, result);
+    return result;
+}
+
+int fs_listfiles(char ***files) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_listfiles(files);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_LIST, start, result);
+    return result;
+}
+
+int fs_listdir(char *name, char ***files) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_listdir(name, files);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_LIST, start, result);
+    return result;
+}
+
+int fs_lseek(int fildes, off_t offset) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = -1;
+    struct file_info *fi = file_enter(fildes, 0);
+    if (fi) {
+        result = do_fs_lseek(fildes, offset);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_LSEEK, start, result);
+    return result;
+}
+
+int fs_truncate(int fildes, off_t length) {
+    uint64_t start = stats_clock();
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = -1;
+    struct file_info *fi = file_enter(fildes, 1);
+    if (fi) {
+        result = do_fs_truncate(fildes, length);
+        file_leave(fildes, fi);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_op(FS_OP_TRUNCATE, start, result);
+    return result;
+}
+
+void *fs_mmap(int fildes, off_t offset, size_t length, int prot) {
+    if (offset < 0 || length == 0 || !(prot & PROT_READ) || (prot & ~(PROT_READ | PROT_WRITE))) {
+        return NULL;
+    }
+    pthread_mutex_lock(&map_lock);
+    void *result = do_fs_mmap(fildes, offset, length, prot);
+    pthread_mutex_unlock(&map_lock);
+    return result;
+}
+
+int fs_msync(void *addr, size_t length) {
+    int result = 0;
+    int i;
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < MAX_MAPPINGS; i++) {
+        struct mapping *m = &mappings[i];
+        if (m->base && (char *) addr < m->base + m->len && (char *) addr + length > m->base) {
+            result |= map_writeback(m);
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    return result;
+}
+
+int fs_munmap(void *addr) {
+    int result = -1;
+    int i;
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].base && mappings[i].addr == addr) {
+            result = map_release(&mappings[i]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    return result;
+}
+
+int fs_defrag(int max_blocks) {
+    pthread_mutex_lock(&map_lock);
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_defrag(max_blocks);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    pthread_mutex_unlock(&map_lock);
+    return result;
+}
+
+int fs_fragmentation(struct fs_fragmentation *out) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&dir_lock);
+    int result = do_fs_fragmentation(out);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
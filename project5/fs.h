@@ -0,0 +1,115 @@
+#ifndef _FS_H_
+#define _FS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/******************************************************************************/
+int make_fs(char *disk_name);  /* create a fresh file system on a new disk    */
+int make_fs_geometry(char *disk_name, off_t disk_size, int block_size);
+                               /* same, disk_size bytes in blocks of          */
+                               /* block_size bytes (a power of two >= 512)    */
+int mount_fs(char *disk_name); /* load the file system stored on a disk       */
+int umount_fs(char *disk_name);/* write everything back and close the disk    */
+
+/* The calls below may be made from several threads at once. Reads of one    */
+/* file run in parallel, writes to different files do too; a descriptor is   */
+/* used by one call at a time.                                                */
+int fs_open(char *name);
+int fs_close(int fildes);
+int fs_create(char *name);
+int fs_delete(char *name);
+ssize_t fs_read(int fildes, void *buf, size_t nbyte);
+ssize_t fs_write(int fildes, void *buf, size_t nbyte);
+off_t fs_get_filesize(int fildes);
+int fs_listfiles(char ***files);
+int fs_lseek(int fildes, off_t offset);
+int fs_truncate(int fildes, off_t length);
+
+/* Names may be paths such as "dir/sub/file"; fs_listfiles lists the root.    */
+int fs_mkdir(char *name);      /* fs_delete removes directories once empty    */
+int fs_listdir(char *name, char ***files);
+int fs_clone(char *src, char *dst);
+                               /* new file dst sharing src's blocks; each     */
+                               /* copies a block only when it writes to it    */
+int fs_set_compression(char *name, int on);
+                               /* store an empty file's data compressed       */
+void *fs_mmap(int fildes, off_t offset, size_t length, int prot);
+                               /* file contents as memory; prot is PROT_READ  */
+                               /* or PROT_READ | PROT_WRITE. Changed pages go */
+                               /* back on fs_msync, fs_close and fs_munmap,   */
+                               /* but never past the end of the file. It is   */
+                               /* read in whole here, so it may be given to   */
+                               /* fs_read and fs_write as a buffer            */
+int fs_msync(void *addr, size_t length);
+                               /* write back changed pages of mappings there  */
+int fs_munmap(void *addr);     /* write back and remove the mapping at addr   */
+
+/* Online defragmentation: each call moves a bounded slice of blocks, so it   */
+/* can be called now and then while the file system is in use.                */
+int fs_defrag(int max_blocks); /* move up to max_blocks blocks of fragmented  */
+                               /* files into runs of adjacent blocks; returns */
+                               /* how many, 0 once nothing more can be moved  */
+
+struct fs_fragmentation {
+    int files;                 /* files holding data                          */
+    int fragmented_files;      /* those in more than one extent               */
+    long long blocks;          /* data blocks in them                         */
+    long long extents;         /* runs of adjacent blocks in their chains;    */
+                               /* equal to files when nothing is fragmented   */
+    int free_blocks;
+    int free_run;              /* longest run of free blocks                  */
+};
+
+int fs_fragmentation(struct fs_fragmentation *out);
+                               /* how fragmented files and free space are     */
+
+int fs_sync();                 /* make data and metadata changes durable      */
+int fs_set_cache_size(int nblocks);
+                               /* resize the buffer cache (in blocks)         */
+int fs_start_flusher(int interval_ms);
+                               /* sync from a background thread periodically */
+int fs_stop_flusher();         /* stop it again (umount_fs does this too)     */
+
+/* Every call below the mount calls is counted, and timed into a histogram of */
+/* powers of two: hist[0] holds calls that took under 1 us, hist[i] those     */
+/* that took from 2^(i-1) up to 2^i us, the last bucket anything longer.      */
+#define FS_OP_OPEN      0
+#define FS_OP_CLOSE     1
+#define FS_OP_CREATE    2
+#define FS_OP_DELETE    3
+#define FS_OP_READ      4
+#define FS_OP_WRITE     5
+#define FS_OP_LSEEK     6
+#define FS_OP_TRUNCATE  7
+#define FS_OP_FILESIZE  8
+#define FS_OP_MKDIR     9
+#define FS_OP_LIST      10     /* fs_listfiles and fs_listdir                 */
+#define FS_OP_CLONE     11
+#define FS_OP_SYNC      12
+#define FS_OPS          13
+#define FS_LAT_BUCKETS  32
+
+struct fs_op_stats {
+    unsigned long long calls;
+    unsigned long long errors; /* calls that returned -1                      */
+    unsigned long long bytes;  /* moved by fs_read and fs_write               */
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long hist[FS_LAT_BUCKETS];
+};
+
+struct fs_stats {
+    struct fs_op_stats op[FS_OPS];
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long cache_writebacks; /* dirty blocks evicted              */
+};
+
+int fs_stats(struct fs_stats *stats);
+                               /* copy the counters since the last reset      */
+int fs_reset_stats();          /* start counting from zero again              */
+/******************************************************************************/
+
+#endif
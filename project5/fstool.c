@@ -0,0 +1,461 @@
+// Bulk copying between the host and a file system image: import copies a
+// host directory tree into an image, export copies an image's tree back out.
+// A reader thread walks the source and fills large chunks while the main
+// thread writes the chunks it already has to the destination, so host I/O
+// and image I/O overlap; totals and throughput are printed at the end.
+// Run with -h for the options.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "disk.h"
+#include "fs.h"
+
+#define MAX_QUEUE 64
+
+// What the reader hands the writer, in the order the writer has to do it.
+// Paths are on the writer's side: in the image on import, on the host on
+// export.
+#define ITEM_MKDIR 0
+#define ITEM_OPEN  1 // create the file, or empty it if it exists
+#define ITEM_DATA  2 // the next len bytes of the open file
+#define ITEM_CLOSE 3
+#define ITEM_END   4 // the reader is done
+
+struct item {
+    int type;
+    char path[PATH_MAX];
+    char *buf; // chunk bytes, the item's own
+    size_t len;
+};
+
+// Settings, from the command line
+static int backend = DISK_FILE;
+static size_t chunk = 4 << 20; // bytes per read or write call
+static int depth = 8; // chunks in flight between the threads
+static off_t make_bytes = 0; // import into a fresh file system of this size
+static int block_bytes = BLOCK_SIZE;
+static int compress = 0;
+
+// The queue between the reader and the writer: a ring of depth items
+static struct item queue[MAX_QUEUE];
+static int queue_head, queue_len;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_put = PTHREAD_COND_INITIALIZER; // an item was added
+static pthread_cond_t queue_took = PTHREAD_COND_INITIALIZER; // an item was done with
+
+// Totals; failures are counted by whichever thread runs into them
+static long long bytes_copied;
+static long files_copied, dirs_copied;
+static int failures;
+static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void failed(const char *what, const char *path) {
+    pthread_mutex_lock(&fail_lock);
+    fprintf(stderr, "fstool: %s %s\n", what, path);
+    failures++;
+    pthread_mutex_unlock(&fail_lock);
+}
+
+// Waits for a free item at the tail of the queue; the reader fills it in and
+// then hands it over with item_put.
+static struct item *item_get(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == depth) {
+        pthread_cond_wait(&queue_took, &queue_lock);
+    }
+    struct item *it = &queue[(queue_head + queue_len) % depth];
+    pthread_mutex_unlock(&queue_lock);
+    return it;
+}
+
+static void item_put(void) {
+    pthread_mutex_lock(&queue_lock);
+    queue_len++;
+    pthread_cond_signal(&queue_put);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void item_send(int type, const char *path) {
+    struct item *it = item_get();
+    it->type = type;
+    snprintf(it->path, sizeof(it->path), "%s", path);
+    it->len = 0;
+    item_put();
+}
+
+static int image_is_dir(const char *path) {
+    char **names;
+    int i;
+    if (fs_listdir((char *) path, &names) < 0) {
+        return 0;
+    }
+    for (i = 0; names[i]; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return 1;
+}
+
+static int join_path(char *out, const char *dir, const char *name) {
+    int n = *dir ? snprintf(out, PATH_MAX, "%s/%s", dir, name) : snprintf(out, PATH_MAX, "%s", name);
+    return n < PATH_MAX ? 0 : -1;
+}
+
+// Import reader: sends the host tree below host for the image directory image.
+static void import_tree(const char *host, const char *image) {
+    char hpath[PATH_MAX], ipath[PATH_MAX];
+    struct dirent *d;
+    struct stat st;
+    DIR *dir = opendir(host);
+
+    if (!dir) {
+        failed("cannot read directory", host);
+        return;
+    }
+    while ((d = readdir(dir))) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+            continue;
+        }
+        if (join_path(hpath, host, d->d_name) < 0 || join_path(ipath, image, d->d_name) < 0) {
+            failed("path too long:", d->d_name);
+            continue;
+        }
+        if (lstat(hpath, &st) < 0) {
+            failed("cannot stat", hpath);
+        } else if (S_ISDIR(st.st_mode)) {
+            item_send(ITEM_MKDIR, ipath);
+            import_tree(hpath, ipath);
+        } else if (S_ISREG(st.st_mode)) {
+            int fd = open(hpath, O_RDONLY);
+            if (fd < 0) {
+                failed("cannot open", hpath);
+                continue;
+            }
+            item_send(ITEM_OPEN, ipath);
+            for (;;) {
+                struct item *it = item_get();
+                ssize_t n = 0;
+                it->len = 0;
+                while (it->len < chunk && (n = read(fd, it->buf + it->len, chunk - it->len)) > 0) {
+                    it->len += n;
+                }
+                if (n < 0) {
+                    failed("cannot read", hpath);
+                }
+                if (it->len == 0) {
+                    break; // the item is simply not handed over
+                }
+                it->type = ITEM_DATA;
+                strcpy(it->path, ipath);
+                item_put();
+                if (n <= 0) {
+                    break;
+                }
+            }
+            close(fd);
+            item_send(ITEM_CLOSE, ipath);
+        } else {
+            fprintf(stderr, "fstool: skipping %s: not a file or directory\n", hpath);
+        }
+    }
+    closedir(dir);
+}
+
+// Export reader: sends the image tree below image for the host directory host.
+static void export_tree(const char *image, const char *host) {
+    char ipath[PATH_MAX], hpath[PATH_MAX];
+    char **names;
+    int i;
+
+    if (fs_listdir(*image ? (char *) image : "/", &names) < 0) {
+        failed("cannot list", *image ? image : "/");
+        return;
+    }
+    for (i = 0; names[i]; i++) {
+        if (join_path(ipath, image, names[i]) < 0 || join_path(hpath, host, names[i]) < 0) {
+            failed("path too long:", names[i]);
+        } else if (image_is_dir(ipath)) {
+            item_send(ITEM_MKDIR, hpath);
+            export_tree(ipath, hpath);
+        } else {
+            int fd = fs_open(ipath);
+            if (fd < 0) {
+                failed("cannot open", ipath);
+                free(names[i]);
+                continue;
+            }
+            item_send(ITEM_OPEN, hpath);
+            for (;;) {
+                struct item *it = item_get();
+                ssize_t n = fs_read(fd, it->buf, chunk);
+                if (n < 0) {
+                    failed("cannot read", ipath);
+                }
+                if (n <= 0) {
+                    break;
+                }
+                it->type = ITEM_DATA;
+                strcpy(it->path, hpath);
+                it->len = n;
+                item_put();
+            }
+            fs_close(fd);
+            item_send(ITEM_CLOSE, hpath);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+struct reader {
+    int import;
+    const char *from, *to;
+};
+
+static void *reader(void *arg) {
+    struct reader *r = arg;
+    if (r->import) {
+        import_tree(r->from, r->to);
+    } else {
+        export_tree(r->from, r->to);
+    }
+    item_send(ITEM_END, "");
+    return NULL;
+}
+
+// Import writer: does one item to the image. fd is the image file being
+// written, -1 after a failure so that the rest of that file is dropped.
+static void import_item(struct item *it, int *fd) {
+    switch (it->type) {
+    case ITEM_MKDIR:
+        if (fs_mkdir(it->path) < 0 && !image_is_dir(it->path)) {
+            failed("cannot make directory", it->path);
+        } else {
+            dirs_copied++;
+        }
+        break;
+    case ITEM_OPEN:
+        if (fs_create(it->path) == 0 && compress) {
+            fs_set_compression(it->path, 1);
+        }
+        if ((*fd = fs_open(it->path)) < 0 || fs_truncate(*fd, 0) < 0) {
+            failed("cannot create", it->path);
+            if (*fd >= 0) {
+                fs_close(*fd);
+            }
+            *fd = -1;
+        }
+        break;
+    case ITEM_DATA:
+        if (*fd >= 0 && fs_write(*fd, it->buf, it->len) != (ssize_t) it->len) {
+            failed("cannot write", it->path);
+            fs_close(*fd);
+            *fd = -1;
+        }
+        if (*fd >= 0) {
+            bytes_copied += it->len;
+        }
+        break;
+    case ITEM_CLOSE:
+        if (*fd >= 0 && fs_close(*fd) < 0) {
+            failed("cannot write", it->path);
+        } else if (*fd >= 0) {
+            files_copied++;
+        }
+        *fd = -1;
+        break;
+    }
+}
+
+// Export writer: does one item to the host, like import_item.
+static void export_item(struct item *it, int *fd) {
+    switch (it->type) {
+    case ITEM_MKDIR:
+        if (mkdir(it->path, 0755) < 0 && errno != EEXIST) {
+            failed("cannot make directory", it->path);
+        } else {
+            dirs_copied++;
+        }
+        break;
+    case ITEM_OPEN:
+        if ((*fd = open(it->path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            failed("cannot create", it->path);
+        }
+        break;
+    case ITEM_DATA:
+        if (*fd >= 0) {
+            size_t done = 0;
+            ssize_t n = 0;
+            while (done < it->len && (n = write(*fd, it->buf + done, it->len - done)) > 0) {
+                done += n;
+            }
+            if (done < it->len) {
+                failed("cannot write", it->path);
+                close(*fd);
+                *fd = -1;
+            } else {
+                bytes_copied += it->len;
+            }
+        }
+        break;
+    case ITEM_CLOSE:
+        if (*fd >= 0 && close(*fd) < 0) {
+            failed("cannot write", it->path);
+        } else if (*fd >= 0) {
+            files_copied++;
+        }
+        *fd = -1;
+        break;
+    }
+}
+
+// Starts the reader and does what it sends until it is done.
+static void copy(int import, const char *from, const char *to) {
+    struct reader r = { import, from, to };
+    pthread_t tid;
+    int fd = -1;
+
+    pthread_create(&tid, NULL, reader, &r);
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_len == 0) {
+            pthread_cond_wait(&queue_put, &queue_lock);
+        }
+        struct item *it = &queue[queue_head];
+        pthread_mutex_unlock(&queue_lock);
+
+        if (it->type == ITEM_END) {
+            break;
+        }
+        if (import) {
+            import_item(it, &fd);
+        } else {
+            export_item(it, &fd);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        queue_head = (queue_head + 1) % depth;
+        queue_len--;
+        pthread_cond_signal(&queue_took);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    pthread_join(tid, NULL);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] import image hostdir [dir]\n"
+            "       %s [options] export image hostdir [dir]\n"
+            "import copies the tree below hostdir into directory dir of the image (default the\n"
+            "root), export copies the tree below dir back out into hostdir\n"
+            "  -b type   backend: file, mmap, ram or direct (default file)\n"
+            "  -r bytes  bytes per read or write call (default 4M)\n"
+            "  -q n      chunks in flight between reading and writing (default 8, at most %d)\n"
+            "  -s MB     import into a new file system of this size instead of the one there\n"
+            "  -B bytes  block size of that file system (default %d)\n"
+            "  -z        store the imported files compressed\n",
+            prog, prog, MAX_QUEUE, BLOCK_SIZE);
+}
+
+int main(int argc, char **argv) {
+    char dir[PATH_MAX] = "";
+    char *image, *host;
+    int c, i, import;
+
+    while ((c = getopt(argc, argv, "b:r:q:s:B:zh")) != -1) {
+        switch (c) {
+        case 'b':
+            backend = !strcmp(optarg, "mmap") ? DISK_MMAP : !strcmp(optarg, "ram") ? DISK_RAM
+                    : !strcmp(optarg, "direct") ? DISK_DIRECT : DISK_FILE;
+            break;
+        case 'r': chunk = atol(optarg); break;
+        case 'q': depth = atoi(optarg); break;
+        case 's': make_bytes = (off_t) atol(optarg) << 20; break;
+        case 'B': block_bytes = atoi(optarg); break;
+        case 'z': compress = 1; break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind < 3 || argc - optind > 4 || chunk < 1 || depth < 1 || depth > MAX_QUEUE
+        || (strcmp(argv[optind], "import") && strcmp(argv[optind], "export"))) {
+        usage(argv[0]);
+        return 1;
+    }
+    import = !strcmp(argv[optind], "import");
+    image = argv[optind + 1];
+    host = argv[optind + 2];
+    if (argc - optind == 4) {
+        char *p = argv[optind + 3];
+        while (*p == '/') {
+            p++;
+        }
+        snprintf(dir, sizeof(dir), "%s", p);
+        for (i = strlen(dir); i > 0 && dir[i - 1] == '/'; i--) {
+            dir[i - 1] = '\0';
+        }
+    }
+
+    for (i = 0; i < depth; i++) {
+        if (!(queue[i].buf = malloc(chunk))) {
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            return 1;
+        }
+    }
+
+    disk_set_backend(backend);
+    if (import && make_bytes && make_fs_geometry(image, make_bytes, block_bytes) < 0) {
+        fprintf(stderr, "%s: cannot make the file system on %s\n", argv[0], image);
+        return 1;
+    }
+    if (mount_fs(image) < 0) {
+        fprintf(stderr, "%s: cannot mount %s\n", argv[0], image);
+        return 1;
+    }
+
+    double start = now();
+    if (import) {
+        // the directories leading to dir, which the tree goes into
+        for (i = 1; dir[i - 1]; i++) {
+            if (dir[i] == '/' || !dir[i]) {
+                char end = dir[i];
+                dir[i] = '\0';
+                if (fs_mkdir(dir) < 0 && !image_is_dir(dir)) {
+                    failed("cannot make directory", dir);
+                }
+                dir[i] = end;
+            }
+        }
+        copy(1, host, dir);
+    } else {
+        if (mkdir(host, 0755) < 0 && errno != EEXIST) {
+            failed("cannot make directory", host);
+        }
+        copy(0, dir, host);
+    }
+    // the copy is only done once it is all on the disk
+    if (umount_fs(image) < 0) {
+        failed("cannot write back", image);
+    }
+    double secs = now() - start;
+
+    printf("%sed %ld files, %ld directories, %.1f MB in %.3f s, %.1f MB/s\n", argv[optind], files_copied,
+           dirs_copied, bytes_copied / (double) (1 << 20), secs, bytes_copied / secs / (1 << 20));
+    if (failures) {
+        fprintf(stderr, "%s: %d failures\n", argv[0], failures);
+    }
+    return failures ? 1 : 0;
+}